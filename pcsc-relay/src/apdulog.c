@@ -0,0 +1,497 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of pcsc-relay.
+ *
+ * pcsc-relay is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * pcsc-relay is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * pcsc-relay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "apdulog.h"
+#include "hex.h"
+#include "pcsc-relay.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define compare_and_swap(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define fetch_and_inc(p) __sync_fetch_and_add((p), 1)
+#define barrier() __sync_synchronize()
+#else
+#define compare_and_swap(p, o, n) (*(p) == (o) ? (*(p) = (n), 1) : 0)
+#define fetch_and_inc(p) ((*(p))++)
+#define barrier()
+#endif
+
+/* number of APDUs in the queue, must be a power of 2 */
+#define APDULOG_SIZE 256
+/* APDUs up to this size are copied into the queue, larger ones are
+ * allocated */
+#define APDULOG_INLINE 272
+/* interval for checking the queue if a wake up was missed */
+#define APDULOG_DRAIN_MS 100
+
+/* LINKTYPE_ISO_14443 with the events of its pseudo-header for frames without
+ * CRC, see ISO14443_EVT_DATA_PCD_TO_PICC_CRC_DROPPED and
+ * ISO14443_EVT_DATA_PICC_TO_PCD_CRC_DROPPED in Wireshark's
+ * epan/dissectors/packet-iso14443.c */
+#define PCAP_LINKTYPE_ISO_14443 264
+#define PCAP_EVT_PCD_TO_PICC 0xFA
+#define PCAP_EVT_PICC_TO_PCD 0xFB
+/* ISO 14443-4 I-block */
+#define PCB_I_BLOCK 0x02
+#define PCB_CID 0x08
+/* CID 15 is reserved */
+#define MAX_CID 14
+
+static int log_text = 0;
+static FILE *capture_file = NULL;
+/* block numbers of the sessions in the capture */
+static unsigned char *blocks = NULL;
+static unsigned int block_count = 0;
+/* output buffer of the writer */
+static char *text_buf = NULL;
+static size_t text_buf_max = 0;
+
+static void write_text(const char *label, const unsigned char *apdu,
+        size_t len)
+{
+    size_t label_len = strlen(label), text_len;
+    char *p;
+
+    text_len = label_len + HEX_DUMP_SIZE(len);
+    if (text_len > text_buf_max) {
+        p = realloc(text_buf, text_len);
+        if (!p)
+            return;
+        text_buf = p;
+        text_buf_max = text_len;
+    }
+
+    memcpy(text_buf, label, label_len);
+    text_len = label_len + hex_dump(text_buf + label_len, apdu, len);
+    fwrite(text_buf, 1, text_len, stdout);
+}
+
+static int write_pcap_header(FILE *f)
+{
+    struct {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t network;
+    } header = {0xa1b2c3d4, 2, 4, 0, 0, 0xffff + 8, PCAP_LINKTYPE_ISO_14443};
+
+    return fwrite(&header, sizeof header, 1, f) == 1;
+}
+
+/* Writes the APDU as ISO 14443-4 I-block, so that it is dissected by common
+ * tools. Sessions are distinguished by the CID. */
+static void write_pcap(const struct timeval *tv, unsigned int session,
+        enum apdulog_type type, const unsigned char *apdu, size_t len)
+{
+    struct {
+        uint32_t sec;
+        uint32_t usec;
+        uint32_t incl_len;
+        uint32_t orig_len;
+    } record;
+    unsigned char prefix[6];
+    size_t prefix_len = 0, frame_len;
+    unsigned char pcb = PCB_I_BLOCK;
+
+    if (session < block_count) {
+        pcb |= blocks[session];
+        if (block_count > 1)
+            pcb |= PCB_CID;
+    }
+
+    frame_len = 1 + ((pcb & PCB_CID) ? 1 : 0) + len;
+    if (frame_len > 0xffff)
+        return;
+
+    /* pseudo-header: version, event and length */
+    prefix[prefix_len++] = 0;
+    prefix[prefix_len++] = type == APDULOG_CAPDU ?
+        PCAP_EVT_PCD_TO_PICC : PCAP_EVT_PICC_TO_PCD;
+    prefix[prefix_len++] = frame_len >> 8;
+    prefix[prefix_len++] = frame_len & 0xff;
+    prefix[prefix_len++] = pcb;
+    if (pcb & PCB_CID)
+        prefix[prefix_len++] = session;
+
+    record.sec = (uint32_t) tv->tv_sec;
+    record.usec = (uint32_t) tv->tv_usec;
+    record.incl_len = (uint32_t) (4 + frame_len);
+    record.orig_len = record.incl_len;
+
+    fwrite(&record, sizeof record, 1, capture_file);
+    fwrite(prefix, 1, prefix_len, capture_file);
+    fwrite(apdu, 1, len, capture_file);
+
+    /* the response closes the exchange of the block */
+    if (type == APDULOG_RAPDU && session < block_count)
+        blocks[session] ^= 1;
+}
+
+static void apdulog_write(const struct timeval *tv, unsigned int session,
+        enum apdulog_type type, const char *label,
+        const unsigned char *apdu, size_t len)
+{
+    if (log_text)
+        write_text(label, apdu, len);
+    if (capture_file)
+        write_pcap(tv, session, type, apdu, len);
+}
+
+static void apdulog_flush(void)
+{
+    if (log_text)
+        fflush(stdout);
+    if (capture_file)
+        fflush(capture_file);
+}
+
+static int open_files(int text, const char *capture, unsigned int sessions)
+{
+    log_text = text;
+
+    if (capture) {
+        if (sessions > MAX_CID + 1) {
+            RELAY_ERROR("Can capture at most %u sessions\n", MAX_CID + 1);
+            return 0;
+        }
+
+        blocks = calloc(sessions, sizeof *blocks);
+        if (!blocks) {
+            RELAY_ERROR("Could not allocate memory for capture\n");
+            return 0;
+        }
+        block_count = sessions;
+
+        capture_file = fopen(capture, "wb");
+        /* flush the header, which must not be written again by a parent
+         * process exiting after fork() */
+        if (!capture_file || !write_pcap_header(capture_file)
+                || fflush(capture_file) != 0) {
+            RELAY_ERROR("Could not write %s: %s\n", capture, strerror(errno));
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void apdulog_close(void)
+{
+    apdulog_flush();
+    if (capture_file)
+        fclose(capture_file);
+    capture_file = NULL;
+    free(blocks);
+    blocks = NULL;
+    block_count = 0;
+    free(text_buf);
+    text_buf = NULL;
+    text_buf_max = 0;
+    log_text = 0;
+}
+
+int apdulog_open(int text, const char *capture, unsigned int sessions)
+{
+    if (!open_files(text, capture, sessions)) {
+        apdulog_close();
+        return 0;
+    }
+
+    return 1;
+}
+
+#ifdef HAVE_PTHREAD
+
+struct log_entry {
+    /* position of the entry + 1 if it is ready to be written, position
+     * + APDULOG_SIZE if it is free for the next round */
+    volatile unsigned long seq;
+    struct timeval tv;
+    unsigned int session;
+    enum apdulog_type type;
+    const char *label;
+    size_t len;
+    /* either inline_apdu or allocated */
+    unsigned char *apdu;
+    unsigned char inline_apdu[APDULOG_INLINE];
+};
+
+static struct log_entry ring[APDULOG_SIZE];
+static volatile unsigned long enqueue_pos = 0;
+/* only changed by the writer, apdulog_abort watches its progress */
+static volatile unsigned long dequeue_pos = 0;
+static volatile unsigned long dropped = 0;
+
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static volatile int running = 0;
+/* set by the writer when it has written everything and returns */
+static volatile int writer_done = 0;
+
+void apdulog(unsigned int session, enum apdulog_type type, const char *label,
+        const unsigned char *apdu, size_t len)
+{
+    struct log_entry *entry;
+    unsigned long pos, seq;
+    long diff;
+
+    if (!running)
+        return;
+
+    /* reserve an entry */
+    pos = enqueue_pos;
+    while (1) {
+        entry = &ring[pos & (APDULOG_SIZE-1)];
+        seq = entry->seq;
+        barrier();
+        diff = (long) (seq - pos);
+        if (diff == 0) {
+            if (compare_and_swap(&enqueue_pos, pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            /* full */
+            fetch_and_inc(&dropped);
+            return;
+        }
+        pos = enqueue_pos;
+    }
+
+    gettimeofday(&entry->tv, NULL);
+    entry->session = session;
+    entry->type = type;
+    entry->label = label;
+    entry->len = len;
+    entry->apdu = entry->inline_apdu;
+    if (len > sizeof entry->inline_apdu) {
+        entry->apdu = malloc(len);
+        if (!entry->apdu) {
+            fetch_and_inc(&dropped);
+            entry->len = 0;
+            entry->apdu = entry->inline_apdu;
+        }
+    }
+    if (entry->len)
+        memcpy(entry->apdu, apdu, len);
+
+    barrier();
+    entry->seq = pos + 1;
+
+    pthread_cond_signal(&writer_cond);
+}
+
+/* writes all queued APDUs, returns the number of APDUs written */
+static size_t drain(void)
+{
+    struct log_entry *entry;
+    unsigned long d;
+    size_t n = 0;
+
+    while (1) {
+        entry = &ring[dequeue_pos & (APDULOG_SIZE-1)];
+        if (entry->seq != dequeue_pos + 1)
+            break;
+        barrier();
+
+        if (entry->len)
+            apdulog_write(&entry->tv, entry->session, entry->type,
+                    entry->label, entry->apdu, entry->len);
+        if (entry->apdu != entry->inline_apdu)
+            free(entry->apdu);
+
+        barrier();
+        entry->seq = dequeue_pos + APDULOG_SIZE;
+        dequeue_pos++;
+        n++;
+    }
+
+    d = dropped;
+    if (d && compare_and_swap(&dropped, d, 0))
+        RELAY_ERROR("%lu APDUs dropped from the log\n", d);
+
+    if (n)
+        apdulog_flush();
+
+    return n;
+}
+
+static void *writer_main(void *arg)
+{
+    struct timespec deadline;
+    struct timeval now;
+
+    (void) arg;
+
+    pthread_mutex_lock(&writer_mutex);
+    while (running) {
+        pthread_mutex_unlock(&writer_mutex);
+        if (drain()) {
+            pthread_mutex_lock(&writer_mutex);
+            continue;
+        }
+        pthread_mutex_lock(&writer_mutex);
+        if (!running)
+            break;
+
+        /* The producers signal without holding the mutex, so a wake up may
+         * be missed. Check the queue periodically in this case. */
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec;
+        deadline.tv_nsec = now.tv_usec*1000 + APDULOG_DRAIN_MS*1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&writer_cond, &writer_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&writer_mutex);
+
+    drain();
+    apdulog_flush();
+    barrier();
+    writer_done = 1;
+
+    return NULL;
+}
+
+int apdulog_start(void)
+{
+    unsigned long i;
+
+    if (running)
+        return 1;
+
+    if (!log_text && !capture_file)
+        /* nothing to log */
+        return 1;
+
+    for (i = 0; i < APDULOG_SIZE; i++)
+        ring[i].seq = i;
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+    dropped = 0;
+    writer_done = 0;
+
+    running = 1;
+    if (0 != pthread_create(&writer_thread, NULL, writer_main, NULL)) {
+        running = 0;
+        RELAY_ERROR("Could not create thread for logging\n");
+        goto err;
+    }
+
+    return 1;
+
+err:
+    apdulog_close();
+    return 0;
+}
+
+void apdulog_stop(void)
+{
+    int join = 0;
+
+    pthread_mutex_lock(&writer_mutex);
+    if (running) {
+        running = 0;
+        join = 1;
+        pthread_cond_broadcast(&writer_cond);
+    }
+    pthread_mutex_unlock(&writer_mutex);
+
+    if (join)
+        pthread_join(writer_thread, NULL);
+    apdulog_close();
+}
+
+int apdulog_abort(void)
+{
+    struct timespec step = {0, 10*1000000L};
+    unsigned long pos;
+    int i;
+
+    if (!running)
+        return 1;
+
+    /* The writer notices this with its next periodic check, so nothing
+     * needs to be signalled or locked here. */
+    running = 0;
+    do {
+        pos = dequeue_pos;
+        for (i = 0; i < 2*APDULOG_DRAIN_MS/10 && !writer_done; i++)
+            nanosleep(&step, NULL);
+    } while (!writer_done && pos != dequeue_pos);
+
+    return writer_done;
+}
+
+#else
+
+/* without threads the APDUs are written right away */
+static int running = 0;
+
+void apdulog(unsigned int session, enum apdulog_type type, const char *label,
+        const unsigned char *apdu, size_t len)
+{
+    struct timeval tv;
+
+    if (!running)
+        return;
+
+    gettimeofday(&tv, NULL);
+    apdulog_write(&tv, session, type, label, apdu, len);
+    apdulog_flush();
+}
+
+int apdulog_start(void)
+{
+    running = log_text || capture_file;
+
+    return 1;
+}
+
+void apdulog_stop(void)
+{
+    running = 0;
+    apdulog_close();
+}
+
+int apdulog_abort(void)
+{
+    running = 0;
+
+    return 1;
+}
+
+#endif
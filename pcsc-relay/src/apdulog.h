@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of pcsc-relay.
+ *
+ * pcsc-relay is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * pcsc-relay is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * pcsc-relay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ * Logging of the relayed APDUs outside of the relay's threads
+ */
+#ifndef _APDULOG_H
+#define _APDULOG_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum apdulog_type {
+    APDULOG_CAPDU,
+    APDULOG_RAPDU,
+};
+
+/**
+ * @brief Open the log
+ *
+ * Relative paths are resolved against the current directory, so this needs to
+ * be called before daemonizing.
+ *
+ * @param[in] text      Whether to print the APDUs as hex dump to stdout
+ * @param[in] capture   PCAP file to write the APDUs to or NULL
+ * @param[in] sessions  Number of relay sessions
+ *
+ * @return 1 on success, 0 on error
+ */
+int apdulog_open(int text, const char *capture, unsigned int sessions);
+
+/**
+ * @brief Start the thread which writes the log opened with \a apdulog_open
+ *
+ * Threads don't survive fork(), so this needs to be called after daemonizing.
+ *
+ * @return 1 on success, 0 on error
+ */
+int apdulog_start(void);
+
+/**
+ * @brief Write the remaining APDUs, stop the thread and close the log
+ */
+void apdulog_stop(void);
+
+/**
+ * @brief Stop the thread from a signal handler
+ *
+ * Neither locks nor joins the thread, but waits as long as it makes progress
+ * writing the remaining APDUs. \a apdulog_stop may be called afterwards if the
+ * thread has finished.
+ *
+ * @return 1 if the thread has finished, 0 if it is stuck, e.g. writing to a
+ * blocked stdout
+ */
+int apdulog_abort(void);
+
+/**
+ * @brief Queue an APDU for logging
+ *
+ * The call doesn't block and doesn't format anything. If the writer can't
+ * keep up and the queue is full, the APDU is dropped from the log.
+ *
+ * @param[in] session  Number of the relay session
+ * @param[in] type     One of \a apdulog_type
+ * @param[in] label    Printed before the hex dump, needs to stay valid until
+ *                     \a apdulog_stop
+ * @param[in] apdu     APDU to log
+ * @param[in] len      Length of \a apdu
+ */
+void apdulog(unsigned int session, enum apdulog_type type, const char *label,
+        const unsigned char *apdu, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of pcsc-relay.
+ *
+ * pcsc-relay is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * pcsc-relay is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * pcsc-relay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Hex formatting of APDUs: The table driven codec of hex.c is compared with
+ * the former implementation using printf and strtoul per byte. Both variants
+ * log to /dev/null and encode and decode the OpenPICC protocol. The outputs
+ * are checked to be identical.
+ */
+#include "hex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_APDU 1024
+
+static const size_t sizes[] = {5, 64, 261, MAX_APDU};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* former hexdump of pcsc-relay.c */
+static void printf_dump(FILE *f, const char *label, const unsigned char *buf,
+        size_t len)
+{
+    size_t i = 0;
+    fprintf(f, "%s", label);
+    while (i < len) {
+        fprintf(f, "%02X", buf[i]);
+        i++;
+        if (i%20)
+            fprintf(f, " ");
+        else if (i != len)
+            fprintf(f, "\n");
+    }
+    fprintf(f, "\n");
+}
+
+static void table_dump(FILE *f, const char *label, const unsigned char *buf,
+        size_t len)
+{
+    char out[64 + HEX_DUMP_SIZE(MAX_APDU)];
+    size_t label_len = strlen(label);
+
+    memcpy(out, label, label_len);
+    fwrite(out, 1, label_len + hex_dump(out + label_len, buf, len), f);
+}
+
+/* former encoding and decoding of opicc.c */
+static size_t sprintf_encode(char *out, const unsigned char *in, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        sprintf(out + 3*i, " %02X", in[i]);
+
+    return 3*len;
+}
+
+static size_t strtoul_decode(unsigned char *out, size_t outlen, const char *in)
+{
+    char *end = (char *) in;
+    size_t pos = 0;
+
+    while (*end && pos < outlen)
+        out[pos++] = strtoul(end, &end, 16);
+
+    return pos;
+}
+
+static int check(const unsigned char *apdu, size_t len, FILE *tmp)
+{
+    char a[HEX_DUMP_SIZE(MAX_APDU) + 64], b[HEX_DUMP_SIZE(MAX_APDU) + 64];
+    unsigned char decoded[MAX_APDU];
+    size_t a_len, b_len;
+
+    rewind(tmp);
+    printf_dump(tmp, "C-APDU:\n", apdu, len);
+    a_len = ftell(tmp);
+    table_dump(tmp, "C-APDU:\n", apdu, len);
+    b_len = ftell(tmp) - a_len;
+    rewind(tmp);
+    if (a_len != b_len
+            || fread(a, 1, a_len, tmp) != a_len
+            || fread(b, 1, b_len, tmp) != b_len
+            || memcmp(a, b, a_len) != 0)
+        return 0;
+
+    a_len = sprintf_encode(a, apdu, len);
+    a[a_len] = '\0';
+    b_len = hex_encode(b, apdu, len);
+    if (a_len != b_len || memcmp(a, b, a_len) != 0)
+        return 0;
+
+    if (hex_decode(decoded, len, b, b_len) != (ssize_t) len
+            || memcmp(decoded, apdu, len) != 0)
+        return 0;
+
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char apdu[MAX_APDU], decoded[MAX_APDU];
+    char encoded[HEX_ENCODE_SIZE(MAX_APDU) + 1];
+    unsigned long long start, t_old, t_new;
+    unsigned long i, n = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t s, len;
+    FILE *null, *tmp;
+
+    null = fopen("/dev/null", "w");
+    tmp = tmpfile();
+    if (!null || !tmp) {
+        perror("Could not open output");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof apdu; i++)
+        apdu[i] = i*7;
+
+    for (s = 0; s < sizeof sizes/sizeof *sizes; s++) {
+        len = sizes[s];
+        if (!check(apdu, len, tmp)) {
+            fprintf(stderr, "Output differs for %lu bytes\n",
+                    (unsigned long) len);
+            return 1;
+        }
+    }
+
+    printf("%lu iterations, ns per APDU\n", n);
+    printf("%6s %10s %10s %10s %10s %10s %10s\n", "bytes",
+            "printf", "table", "sprintf", "encode", "strtoul", "decode");
+    for (s = 0; s < sizeof sizes/sizeof *sizes; s++) {
+        len = sizes[s];
+        printf("%6lu", (unsigned long) len);
+
+        start = now_ns();
+        for (i = 0; i < n; i++)
+            printf_dump(null, "C-APDU:\n", apdu, len);
+        t_old = now_ns() - start;
+        start = now_ns();
+        for (i = 0; i < n; i++)
+            table_dump(null, "C-APDU:\n", apdu, len);
+        t_new = now_ns() - start;
+        printf(" %10.1f %10.1f", (double) t_old/n, (double) t_new/n);
+
+        start = now_ns();
+        for (i = 0; i < n; i++)
+            sprintf_encode(encoded, apdu, len);
+        t_old = now_ns() - start;
+        start = now_ns();
+        for (i = 0; i < n; i++)
+            hex_encode(encoded, apdu, len);
+        t_new = now_ns() - start;
+        printf(" %10.1f %10.1f", (double) t_old/n, (double) t_new/n);
+
+        encoded[hex_encode(encoded, apdu, len)] = '\0';
+        start = now_ns();
+        for (i = 0; i < n; i++)
+            strtoul_decode(decoded, len, encoded);
+        t_old = now_ns() - start;
+        start = now_ns();
+        for (i = 0; i < n; i++)
+            hex_decode(decoded, len, encoded, 3*len);
+        t_new = now_ns() - start;
+        printf(" %10.1f %10.1f\n", (double) t_old/n, (double) t_new/n);
+    }
+
+    fclose(tmp);
+    fclose(null);
+
+    return 0;
+}
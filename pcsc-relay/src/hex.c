@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of pcsc-relay.
+ *
+ * pcsc-relay is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * pcsc-relay is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * pcsc-relay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "hex.h"
+
+/* two hex digits for every byte */
+static const char hex_digits[] =
+    "000102030405060708090A0B0C0D0E0F"
+    "101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F"
+    "303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F"
+    "505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F"
+    "707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F"
+    "909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+    "B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+    "D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+    "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/* value of a hex digit plus one, 0 for other characters */
+static const unsigned char hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+size_t hex_dump(char *out, const unsigned char *in, size_t len)
+{
+    char *p = out;
+    size_t i;
+
+    for (i = 1; i <= len; i++) {
+        p[0] = hex_digits[2*in[i-1]];
+        p[1] = hex_digits[2*in[i-1]+1];
+        if (i%HEX_DUMP_WIDTH) {
+            p[2] = ' ';
+            p += 3;
+        } else if (i != len) {
+            p[2] = '\n';
+            p += 3;
+        } else {
+            p += 2;
+        }
+    }
+    *p++ = '\n';
+
+    return p - out;
+}
+
+size_t hex_encode(char *out, const unsigned char *in, size_t len)
+{
+    char *p = out;
+    unsigned char b;
+
+    while (len--) {
+        b = *in++;
+        p[0] = ' ';
+        p[1] = hex_digits[2*b];
+        p[2] = hex_digits[2*b+1];
+        p += 3;
+    }
+
+    return p - out;
+}
+
+static int is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f'
+        || c == '\r';
+}
+
+ssize_t hex_decode(unsigned char *out, size_t outlen,
+        const char *in, size_t inlen)
+{
+    const char *end = in + inlen;
+    size_t pos = 0;
+    unsigned int b;
+
+    while (pos < outlen) {
+        while (in < end && is_space(*in))
+            in++;
+        if (in >= end || !hex_values[(unsigned char) *in])
+            break;
+
+        b = 0;
+        while (in < end && hex_values[(unsigned char) *in]) {
+            b = (b << 4) | (hex_values[(unsigned char) *in] - 1);
+            if (b > 0xff)
+                return -1;
+            in++;
+        }
+        out[pos++] = b;
+    }
+
+    return pos;
+}
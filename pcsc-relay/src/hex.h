@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of pcsc-relay.
+ *
+ * pcsc-relay is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * pcsc-relay is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * pcsc-relay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ * Table driven hex encoding for logging and the OpenPICC protocol
+ */
+#ifndef _HEX_H
+#define _HEX_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Bytes per line of hex_dump() */
+#define HEX_DUMP_WIDTH 20
+
+/** Maximum size of the output of hex_dump() for @a len bytes */
+#define HEX_DUMP_SIZE(len) (3*(len)+1)
+
+/** Size of the output of hex_encode() for @a len bytes */
+#define HEX_ENCODE_SIZE(len) (3*(len))
+
+/**
+ * @brief Formats bytes as in the log of pcsc-relay
+ *
+ * Each byte is written as two upper case hex digits followed by a space.
+ * After #HEX_DUMP_WIDTH bytes a new line is started. The output is terminated
+ * by a new line, but not by '\\0'.
+ *
+ * @param[out] out  buffer of at least HEX_DUMP_SIZE(@a len) characters
+ * @param[in]  in   bytes to format
+ * @param[in]  len  number of bytes
+ *
+ * @return number of characters written
+ */
+size_t hex_dump(char *out, const unsigned char *in, size_t len);
+
+/**
+ * @brief Encodes bytes as " XX" each, which is used by the OpenPICC
+ *
+ * @param[out] out  buffer of at least HEX_ENCODE_SIZE(@a len) characters,
+ *                  which is not terminated by '\\0'
+ * @param[in]  in   bytes to encode
+ * @param[in]  len  number of bytes
+ *
+ * @return number of characters written
+ */
+size_t hex_encode(char *out, const unsigned char *in, size_t len);
+
+/**
+ * @brief Decodes white space separated hex numbers of one byte each
+ *
+ * Decoding stops at the first character which is neither a hex digit nor
+ * white space or when @a outlen bytes are decoded.
+ *
+ * @param[out] out     decoded bytes
+ * @param[in]  outlen  maximum number of bytes to decode
+ * @param[in]  in      hex encoded string
+ * @param[in]  inlen   length of @a in
+ *
+ * @return number of bytes decoded or -1 if a number exceeds one byte
+ */
+ssize_t hex_decode(unsigned char *out, size_t outlen,
+        const char *in, size_t inlen);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
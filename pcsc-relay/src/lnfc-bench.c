@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of pcsc-relay.
+ *
+ * pcsc-relay is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * pcsc-relay is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * pcsc-relay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput of the libnfc driver: The functions of libnfc are replaced by a
+ * mock nfc_device, which plays the reader. It splits the C-APDUs into
+ * ISO 14443-4 blocks of the FSC announced in the ATS, fetches long responses
+ * with GET RESPONSE (see --libnfc-get-response) and counts the blocks exchanged over RF. A card behind the
+ * driver stores UPDATE BINARY and answers READ BINARY. Both sides check the
+ * transferred data.
+ */
+#include "lnfc.c"
+
+#include <time.h>
+
+int verbose = -1;
+
+#ifdef ENABLE_LIBNFC
+
+#define FILE_SIZE 4096
+/* PCB and CRC_A of an I-block without CID and NAD */
+#define BLOCK_OVERHEAD 3
+/* frame size of the reader */
+#define MOCK_FSD 256
+/* 106 kbit/s with parity bit */
+#define US_PER_BYTE (9*1000000.0/106000)
+/* minimum frame delay time */
+#define US_PER_BLOCK 86
+
+static const unsigned int fsc_table[] = {16, 24, 32, 40, 48, 64, 96, 128, 256};
+
+static unsigned char file[FILE_SIZE];
+static unsigned char card_file[FILE_SIZE];
+
+/* state of the mock reader */
+static struct {
+    /* forces an FSCI instead of the one of the ATS if >= 0 */
+    int fsci;
+    unsigned int fsc;
+    /* C-APDUs to send */
+    size_t transfer;
+    unsigned int remaining;
+    int update;
+    unsigned char capdu[4+3+FILE_SIZE+2];
+    size_t capdu_len;
+    size_t capdu_sent;
+    unsigned char response[FILE_SIZE+2];
+    size_t response_len;
+    /* statistics */
+    unsigned long blocks;
+    unsigned long bytes;
+    unsigned long host_calls;
+    unsigned long apdus;
+    int failed;
+} mock;
+
+static int mock_device;
+static int mock_context;
+
+void nfc_init(nfc_context **context)
+{
+    *context = (nfc_context *) &mock_context;
+}
+
+void nfc_exit(nfc_context *context)
+{
+}
+
+nfc_device *nfc_open(nfc_context *context, const char *connstring)
+{
+    return (nfc_device *) &mock_device;
+}
+
+void nfc_close(nfc_device *pnd)
+{
+}
+
+size_t nfc_list_devices(nfc_context *context, nfc_connstring connstrings[],
+        size_t connstrings_len)
+{
+    return 1;
+}
+
+const char *nfc_device_get_name(nfc_device *pnd)
+{
+    return "mock";
+}
+
+const char *nfc_strerror(const nfc_device *pnd)
+{
+    return "mock error";
+}
+
+int nfc_abort_command(nfc_device *pnd)
+{
+    return 0;
+}
+
+/* accounts for a chain of blocks carrying len bytes of INF, each acknowledged
+ * by the other side */
+static void mock_chain(size_t len, unsigned int fs)
+{
+    size_t n = len ? (len + fs - BLOCK_OVERHEAD - 1)/(fs - BLOCK_OVERHEAD) : 1;
+
+    mock.blocks += 2*n - 1;
+    mock.bytes += len + n*BLOCK_OVERHEAD + (n - 1)*BLOCK_OVERHEAD;
+}
+
+static void mock_next_capdu(void)
+{
+    size_t len = mock.transfer;
+
+    mock.capdu[0] = 0x00;
+    mock.capdu[2] = 0x00;
+    mock.capdu[3] = 0x00;
+    if (mock.update) {
+        mock.capdu[1] = 0xD6;
+        if (len <= 0xff) {
+            mock.capdu[4] = len;
+            memcpy(mock.capdu + 5, file, len);
+            mock.capdu_len = 5 + len;
+        } else {
+            mock.capdu[4] = 0x00;
+            mock.capdu[5] = len >> 8;
+            mock.capdu[6] = len & 0xff;
+            memcpy(mock.capdu + 7, file, len);
+            mock.capdu_len = 7 + len;
+        }
+    } else {
+        mock.capdu[1] = 0xB0;
+        if (len <= 0xff) {
+            mock.capdu[4] = len;
+            mock.capdu_len = 5;
+        } else {
+            mock.capdu[4] = 0x00;
+            mock.capdu[5] = len >> 8;
+            mock.capdu[6] = len & 0xff;
+            mock.capdu_len = 7;
+        }
+    }
+    mock.capdu_sent = 0;
+    mock.response_len = 0;
+}
+
+/* returns the next block of the C-APDU to the driver */
+static int mock_receive(uint8_t *rx, size_t rx_len)
+{
+    size_t len;
+
+    mock.host_calls++;
+
+    if (mock.capdu_sent == mock.capdu_len) {
+        if (!mock.remaining)
+            return -1;
+        mock.remaining--;
+        mock.update = !mock.update;
+        mock_next_capdu();
+        mock_chain(mock.capdu_len, mock.fsc);
+    }
+
+    len = mock.capdu_len - mock.capdu_sent;
+    if (len > mock.fsc - BLOCK_OVERHEAD)
+        len = mock.fsc - BLOCK_OVERHEAD;
+    if (len > rx_len)
+        return -1;
+    memcpy(rx, mock.capdu + mock.capdu_sent, len);
+    mock.capdu_sent += len;
+
+    return len;
+}
+
+int nfc_target_init(nfc_device *pnd, nfc_target *pnt, uint8_t *pbtRx,
+        size_t szRx, int timeout)
+{
+    unsigned int fsci = mock.fsci >= 0 ? mock.fsci
+        : pnt->nti.nai.abtAts[0] & 0x0f;
+
+    if (fsci >= sizeof fsc_table/sizeof *fsc_table)
+        fsci = sizeof fsc_table/sizeof *fsc_table - 1;
+    mock.fsc = fsc_table[fsci];
+
+    return mock_receive(pbtRx, szRx);
+}
+
+int nfc_target_receive_bytes(nfc_device *pnd, uint8_t *pbtRx, size_t szRx,
+        int timeout)
+{
+    return mock_receive(pbtRx, szRx);
+}
+
+int nfc_target_send_bytes(nfc_device *pnd, const uint8_t *pbtTx, size_t szTx,
+        int timeout)
+{
+    size_t expected;
+
+    mock.host_calls++;
+    mock_chain(szTx, MOCK_FSD);
+
+    if (szTx < 2 || mock.response_len + szTx - 2 > sizeof mock.response) {
+        mock.failed = 1;
+        return -1;
+    }
+    memcpy(mock.response + mock.response_len, pbtTx, szTx);
+    mock.response_len += szTx - 2;
+
+    if (pbtTx[szTx-2] == 0x61) {
+        /* fetch the rest with GET RESPONSE */
+        mock.capdu[0] = 0x00;
+        mock.capdu[1] = 0xC0;
+        mock.capdu[2] = 0x00;
+        mock.capdu[3] = 0x00;
+        mock.capdu[4] = pbtTx[szTx-1];
+        mock.capdu_len = 5;
+        mock.capdu_sent = 0;
+        mock_chain(mock.capdu_len, mock.fsc);
+        return szTx;
+    }
+
+    expected = mock.update ? 0 : mock.transfer;
+    if (mock.response_len != expected
+            || memcmp(mock.response, file, expected) != 0
+            || mock.response[expected] != 0x90
+            || mock.response[expected+1] != 0x00)
+        mock.failed = 1;
+    mock.apdus++;
+
+    return szTx;
+}
+
+/* the card behind the relay */
+static size_t card_transmit(const unsigned char *capdu, size_t len,
+        unsigned char *rapdu)
+{
+    size_t lc, le;
+
+    if (len >= 7 && capdu[4] == 0) {
+        lc = len > 7 ? (capdu[5] << 8) | capdu[6] : 0;
+        le = len == 7 ? (capdu[5] << 8) | capdu[6] : 0;
+        capdu += 7;
+    } else {
+        lc = len > 5 ? capdu[4] : 0;
+        le = len == 5 ? capdu[4] : 0;
+        capdu += 5;
+    }
+
+    if (lc > FILE_SIZE || le > FILE_SIZE) {
+        rapdu[0] = 0x67;
+        rapdu[1] = 0x00;
+        return 2;
+    }
+    if (lc) {
+        memcpy(card_file, capdu, lc);
+        le = 0;
+    } else {
+        memcpy(rapdu, card_file, le);
+    }
+    rapdu[le] = 0x90;
+    rapdu[le+1] = 0x00;
+
+    return le + 2;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static int run(int fsci, size_t transfer, unsigned int n)
+{
+    static unsigned char rapdu[FILE_SIZE+2];
+    driver_data_t *data = NULL;
+    unsigned char *capdu = NULL;
+    size_t len;
+    unsigned long long start, t;
+    double rf_ms;
+
+    memset(&mock, 0, sizeof mock);
+    mock.fsci = fsci;
+    mock.transfer = transfer;
+    /* every transfer is one UPDATE BINARY and one READ BINARY */
+    mock.remaining = 2*n;
+    /* toggled for every C-APDU, starts with UPDATE BINARY */
+    mock.update = 0;
+
+    start = now_ns();
+    if (!lnfc_connect(&data, 0)) {
+        fprintf(stderr, "Could not connect to the mock device\n");
+        return 0;
+    }
+    while (lnfc_receive_capdu(data, &capdu, &len)) {
+        if (!lnfc_send_rapdu(data, rapdu, card_transmit(capdu, len, rapdu)))
+            break;
+    }
+    t = now_ns() - start;
+    lnfc_disconnect(data);
+    free(capdu);
+
+    if (mock.failed || mock.apdus != 2*n) {
+        fprintf(stderr, "Transfer of %lu bytes failed\n",
+                (unsigned long) transfer);
+        return 0;
+    }
+
+    rf_ms = (mock.bytes*US_PER_BYTE + mock.blocks*US_PER_BLOCK)/1000/n;
+    printf("%5u %6lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            mock.fsc, (unsigned long) transfer,
+            (double) mock.blocks/n, (double) mock.host_calls/n,
+            rf_ms, 2*transfer/rf_ms, (double) t/n/1000);
+
+    return 1;
+}
+
+static const size_t sizes[] = {128, 1024, FILE_SIZE};
+
+int main(int argc, char **argv)
+{
+    unsigned int i, n = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+    size_t s;
+
+    for (i = 0; i < sizeof file; i++)
+        file[i] = i*7;
+    lnfcgetresponse = 1;
+
+    printf("%u transfers, each is an UPDATE BINARY and a READ BINARY\n", n);
+    printf("per transfer: RF blocks, calls to the PN53X, "
+            "RF time and throughput at 106 kbit/s, CPU time\n");
+    printf("%5s %6s %10s %10s %10s %10s %10s\n", "FSC", "bytes",
+            "blocks", "host", "RF ms", "bytes/ms", "CPU us");
+    for (s = 0; s < sizeof sizes/sizeof *sizes; s++) {
+        /* FSCI 5 was announced before */
+        if (!run(5, sizes[s], n)
+                || !run(-1, sizes[s], n))
+            return 1;
+    }
+
+    return 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+    fprintf(stderr, "Compiled without support for libnfc\n");
+    return 1;
+}
+
+#endif
@@ -22,18 +22,42 @@
 
 #include "pcsc-relay.h"
 
+int lnfcgetresponse = 0;
+
 #ifdef ENABLE_LIBNFC
 
 #include <nfc/nfc.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* The PN53X handles ISO 14443-4 itself and exchanges at most a short APDU
+ * with the host at once. Longer APDUs are split into multiple frames. */
+#define LNFC_FRAME_MAX (4+1+0xff+1)
+/* largest R-APDU sent at once, longer ones are fetched with GET RESPONSE if
+ * lnfcgetresponse is set */
+#define LNFC_RAPDU_MAX (0x100+2)
+/* header, extended Lc, data and extended Le */
+#define LNFC_CAPDU_MAX (4+3+0xffff+2)
+/* time the reader may take for the next block of a chained C-APDU */
+#define LNFC_CHAIN_TIMEOUT_MS 500
+/* Announces frames of 256 bytes in the ATS, which is the largest FSC of
+ * ISO/IEC 14443-4:2008 and the largest frame of the PN53X */
+#define LNFC_FSCI 8
+
 struct lnfc_data {
-    /* PN53X only supports short APDUs */
-    uint8_t abtCapdu[4+1+0xff+1];
-    int iCapduLen;
+    uint8_t abtFrame[LNFC_FRAME_MAX];
+    int iFrameLen;
+    /* whether abtFrame holds the frame received by nfc_target_init */
+    int framePending;
+    /* rest of the last R-APDU (without status bytes), which is sent on GET
+     * RESPONSE */
+    unsigned char *rest;
+    size_t restLen;
+    size_t restMax;
+    unsigned char sw[2];
     nfc_device *pndTarget;
     nfc_context *context;
+    unsigned int session;
 };
 
 
@@ -107,9 +131,32 @@ static size_t get_historical_bytes(unsigned char *atr, size_t atrlen,
 }
 #endif
 
-static int lnfc_connect(driver_data_t **driver_data)
+static int lnfc_open(struct lnfc_data *data)
+{
+    if (!data->session) {
+        /* use the default device, which may be configured for libnfc */
+        data->pndTarget = nfc_open(data->context, NULL);
+    } else {
+        /* session n uses the n-th device found */
+        nfc_connstring *connstrings = malloc((data->session+1) * sizeof *connstrings);
+        data->pndTarget = NULL;
+        if (connstrings && nfc_list_devices(data->context, connstrings,
+                    data->session+1) > data->session)
+            data->pndTarget = nfc_open(data->context, connstrings[data->session]);
+        free(connstrings);
+    }
+    if (data->pndTarget == NULL) {
+        RELAY_ERROR("Error connecting to NFC emulator device\n");
+        return 0;
+    }
+
+    PRINTF("Connected to %s\n", nfc_device_get_name(data->pndTarget));
+
+    return 1;
+}
+
+static int lnfc_init_target(struct lnfc_data *data)
 {
-    struct lnfc_data *data;
     /* data derived from German (test) identity card issued 2010 */
     nfc_target ntEmulatedTarget = {
         .nti.nai.abtAtqa = {0x00, 0x08},
@@ -128,11 +175,34 @@ static int lnfc_connect(driver_data_t **driver_data)
     ntEmulatedTarget.nti.nai.abtAtqa[1] &= (0xFF-0x40);
     // First byte of UID is always automatically replaced by 0x08 in this mode anyway
     ntEmulatedTarget.nti.nai.abtUid[0] = 0x08;
-    ntEmulatedTarget.nti.nai.abtAts[0] = 0x75;
+    /* TA(1), TB(1), TC(1) and FSCI */
+    ntEmulatedTarget.nti.nai.abtAts[0] = 0x70 | LNFC_FSCI;
     ntEmulatedTarget.nti.nai.abtAts[1] = 0x33;
     ntEmulatedTarget.nti.nai.abtAts[2] = 0x92;
     ntEmulatedTarget.nti.nai.abtAts[3] = 0x03;
 
+    DEBUG("Waiting for a command that is not part of the anti-collision...\n");
+    data->iFrameLen = nfc_target_init(data->pndTarget, &ntEmulatedTarget, data->abtFrame, sizeof data->abtFrame, 0);
+    if (data->iFrameLen < 0) {
+        RELAY_ERROR("nfc_target_init: %s\n", nfc_strerror(data->pndTarget));
+        /* the device is opened again when reconnecting */
+        nfc_close (data->pndTarget);
+        data->pndTarget = NULL;
+        return 0;
+    }
+    DEBUG("Initialized NFC emulator\n");
+    /* the first C-APDU has already been received */
+    data->framePending = data->iFrameLen > 0;
+    data->restLen = 0;
+
+
+    return 1;
+}
+
+static int lnfc_connect(driver_data_t **driver_data, unsigned int session)
+{
+    struct lnfc_data *data;
+
     if (!driver_data)
         return 0;
 
@@ -141,6 +211,13 @@ static int lnfc_connect(driver_data_t **driver_data)
     if (!data)
         return 0;
     *driver_data = data;
+    data->pndTarget = NULL;
+    data->context = NULL;
+    data->session = session;
+    data->framePending = 0;
+    data->rest = NULL;
+    data->restLen = 0;
+    data->restMax = 0;
 
 
     nfc_init(&data->context);
@@ -149,25 +226,27 @@ static int lnfc_connect(driver_data_t **driver_data)
         return 0;
     }
 
-    data->pndTarget = nfc_open(data->context, NULL);
-    if (data->pndTarget == NULL) {
-        RELAY_ERROR("Error connecting to NFC emulator device\n");
+    if (!lnfc_open(data))
         return 0;
-    }
 
-    PRINTF("Connected to %s\n", nfc_device_get_name(data->pndTarget));
+    return lnfc_init_target(data);
+}
 
-    DEBUG("Waiting for a command that is not part of the anti-collision...\n");
-    data->iCapduLen = nfc_target_init(data->pndTarget, &ntEmulatedTarget, data->abtCapdu, sizeof data->abtCapdu, 0);
-    if (data->iCapduLen < 0) {
-        RELAY_ERROR("nfc_target_init: %s\n", nfc_strerror(data->pndTarget));
-        nfc_close (data->pndTarget);
+static int lnfc_reconnect(driver_data_t *driver_data)
+{
+    struct lnfc_data *data = driver_data;
+
+    if (!data || !data->context)
         return 0;
-    }
-    DEBUG("Initialized NFC emulator\n");
 
 
-    return 1;
+    /* keep the device open and only restart the emulation */
+    if (data->pndTarget)
+        nfc_abort_command(data->pndTarget);
+    else if (!lnfc_open(data))
+        return 0;
+
+    return lnfc_init_target(data);
 }
 
 static int lnfc_disconnect(driver_data_t *driver_data)
@@ -182,6 +261,7 @@ static int lnfc_disconnect(driver_data_t *driver_data)
         }
         if (data->context)
             nfc_exit(data->context);
+        free(data->rest);
         free(data);
     }
 
@@ -189,57 +269,180 @@ static int lnfc_disconnect(driver_data_t *driver_data)
     return 1;
 }
 
-static int lnfc_receive_capdu(driver_data_t *driver_data,
-        unsigned char **capdu, size_t *len)
+/* Returns the length of the C-APDU, which may be more than what has been
+ * received so far if the reader chained it over multiple blocks. libnfc
+ * doesn't tell us whether more blocks follow, so the length is derived from
+ * the header. Le is only included if it is received together with the last
+ * byte of the data. A malformed header is detected by waiting for the next
+ * block with LNFC_CHAIN_TIMEOUT_MS. */
+static size_t lnfc_capdu_len(const unsigned char *capdu, size_t len)
 {
-    struct lnfc_data *data = driver_data;
-    unsigned char *p;
+    size_t lc;
 
-    if (!data || !capdu || !len)
-        return 0;
+    if (len <= 5)
+        /* case 1 or case 2 short */
+        return len;
+
+    if (capdu[4] != 0) {
+        /* short Lc */
+        lc = capdu[4];
+        return len > 5 + lc ? len : 5 + lc;
+    }
 
+    if (len < 7)
+        return 7;
+
+    lc = (capdu[5] << 8) | capdu[6];
+    if (len == 7 || lc == 0)
+        /* case 2 extended */
+        return 7;
+
+    /* extended Lc */
+    return len > 7 + lc ? len : 7 + lc;
+}
+
+/* receives a frame, waiting at most timeout ms or forever if it is 0 */
+static int lnfc_receive_frame(struct lnfc_data *data, int timeout)
+{
+    if (data->framePending) {
+        data->framePending = 0;
+        return 1;
+    }
 
     // Receive external reader command through target
-    data->iCapduLen = nfc_target_receive_bytes(data->pndTarget, data->abtCapdu, sizeof data->abtCapdu, 0);
-    if (data->iCapduLen < 0) {
-        RELAY_ERROR ("nfc_target_receive_bytes: %s\n", nfc_strerror(data->pndTarget));
+    data->iFrameLen = nfc_target_receive_bytes(data->pndTarget, data->abtFrame, sizeof data->abtFrame, timeout);
+    if (data->iFrameLen < 0) {
+        if (data->iFrameLen != NFC_ETIMEOUT)
+            RELAY_ERROR ("nfc_target_receive_bytes: %s\n", nfc_strerror(data->pndTarget));
         return 0;
     }
 
+    return 1;
+}
 
-    p = realloc(*capdu, data->iCapduLen);
-    if (!p) {
-        RELAY_ERROR("Error allocating memory for C-APDU\n");
+static int lnfc_send_frame(struct lnfc_data *data,
+        const unsigned char *frame, size_t len)
+{
+    int r = nfc_target_send_bytes(data->pndTarget, frame, len, -1);
+    if (r < 0) {
+        RELAY_ERROR ("nfc_target_send_bytes: %s\n", nfc_strerror(data->pndTarget));
         return 0;
     }
-    memcpy(p, data->abtCapdu, data->iCapduLen);
-    *capdu = p;
-    *len = data->iCapduLen;
-
+    if ((size_t) r < len)
+        INFO ("Transmitted %u less bytes than desired: %s\n", (unsigned int) len-r, nfc_strerror(data->pndTarget));
 
     return 1;
 }
 
+/* sends up to le bytes of the rest of the R-APDU */
+static int lnfc_send_rest(struct lnfc_data *data, size_t le)
+{
+    unsigned char frame[LNFC_RAPDU_MAX];
+    size_t len = data->restLen;
+
+    if (len > le)
+        len = le;
+    memcpy(frame, data->rest, len);
+    data->restLen -= len;
+    memmove(data->rest, data->rest + len, data->restLen);
+
+    if (data->restLen) {
+        /* more data available */
+        frame[len] = 0x61;
+        frame[len+1] = data->restLen > 0xff ? 0x00 : data->restLen;
+    } else {
+        frame[len] = data->sw[0];
+        frame[len+1] = data->sw[1];
+    }
+
+    return lnfc_send_frame(data, frame, len + 2);
+}
+
+static int lnfc_receive_capdu(driver_data_t *driver_data,
+        unsigned char **capdu, size_t *len)
+{
+    struct lnfc_data *data = driver_data;
+    unsigned char *p;
+    size_t received;
+
+    if (!data || !capdu || !len)
+        return 0;
+
+
+    while (1) {
+        /* collect the frames of the C-APDU */
+        received = 0;
+        do {
+            if (!lnfc_receive_frame(data,
+                        received ? LNFC_CHAIN_TIMEOUT_MS : 0)) {
+                if (received && data->iFrameLen == NFC_ETIMEOUT) {
+                    /* Lc didn't announce a chained C-APDU, let the card
+                     * judge the malformed one */
+                    INFO("Forwarding C-APDU, which is shorter than its Lc\n");
+                    break;
+                }
+                return 0;
+            }
+
+            if (received + data->iFrameLen > LNFC_CAPDU_MAX) {
+                RELAY_ERROR("C-APDU too long\n");
+                return 0;
+            }
+            p = realloc(*capdu, received + data->iFrameLen);
+            if (!p) {
+                RELAY_ERROR("Error allocating memory for C-APDU\n");
+                return 0;
+            }
+            memcpy(p + received, data->abtFrame, data->iFrameLen);
+            *capdu = p;
+            received += data->iFrameLen;
+        } while (received < lnfc_capdu_len(*capdu, received));
+
+        /* answer GET RESPONSE for the rest of the last R-APDU ourselves */
+        if (data->restLen && received == 5
+                && (*capdu)[1] == 0xC0 && (*capdu)[2] == 0 && (*capdu)[3] == 0) {
+            if (!lnfc_send_rest(data, (*capdu)[4] ? (*capdu)[4] : 0x100))
+                return 0;
+            continue;
+        }
+        data->restLen = 0;
+
+        *len = received;
+        return 1;
+    }
+}
+
 static int lnfc_send_rapdu(driver_data_t *driver_data,
         const unsigned char *rapdu, size_t len)
 {
     struct lnfc_data *data = driver_data;
-    int r;
+    unsigned char *p;
 
     if (!data || !rapdu)
         return 0;
 
 
-    r = nfc_target_send_bytes(data->pndTarget, rapdu, len, -1);
-    if (r < 0) {
-        RELAY_ERROR ("nfc_target_send_bytes: %s\n", nfc_strerror(data->pndTarget));
-        return 0;
-    }
-    if (r < len)
-        INFO ("Transmitted %u less bytes than desired: %s\n", (unsigned int) len-r, nfc_strerror(data->pndTarget));
+    if (len <= LNFC_RAPDU_MAX || !lnfcgetresponse)
+        /* the device reports an error if the R-APDU is too long */
+        return lnfc_send_frame(data, rapdu, len);
 
+    /* Keep what doesn't fit into a frame and tell the reader to fetch it
+     * with GET RESPONSE */
+    if (data->restMax < len - 2) {
+        p = realloc(data->rest, len - 2);
+        if (!p) {
+            RELAY_ERROR("Error allocating memory for R-APDU\n");
+            return 0;
+        }
+        data->rest = p;
+        data->restMax = len - 2;
+    }
+    memcpy(data->rest, rapdu, len - 2);
+    data->restLen = len - 2;
+    data->sw[0] = rapdu[len-2];
+    data->sw[1] = rapdu[len-1];
 
-    return 1;
+    return lnfc_send_rest(data, LNFC_RAPDU_MAX - 2);
 }
 
 #else
@@ -250,7 +453,12 @@ static int error(void)
     return 0;
 }
 
-static int lnfc_connect(driver_data_t **driver_data)
+static int lnfc_connect(driver_data_t **driver_data, unsigned int session)
+{
+    return error();
+}
+
+static int lnfc_reconnect(driver_data_t *driver_data)
 {
     return error();
 }
@@ -276,6 +484,7 @@ static int lnfc_send_rapdu(driver_data_t *driver_data,
 
 struct rf_driver driver_libnfc = {
     .connect = lnfc_connect,
+    .reconnect = lnfc_reconnect,
     .disconnect = lnfc_disconnect,
     .receive_capdu = lnfc_receive_capdu,
     .send_rapdu = lnfc_send_rapdu,
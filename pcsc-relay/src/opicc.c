@@ -17,34 +17,75 @@
  * pcsc-relay.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "config.h"
+#include "hex.h"
 #include "pcsc-relay.h"
 #include <stdio.h>
 
+int piccbinary = 0;
+unsigned int piccbaudrate = 115200;
+
 #if HAVE_TCGETATTR
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
 #include <termios.h>
-
+#include <unistd.h>
+
+/* bytes to read at once from the device */
+#define PICC_READ_SIZE 256
+/* binary frame: length on 2 bytes, APDU and CRC on 2 bytes */
+#define PICC_FRAME_OVERHEAD 4
+/* A partial frame is dropped if its next byte doesn't arrive within this
+ * time, so that a corrupted length doesn't swallow the following frames. */
+#define PICC_FRAME_TIMEOUT_MS 50
+
+static const struct {
+    unsigned int baudrate;
+    speed_t speed;
+} picc_speeds[] = {
+    {9600, B9600},
+    {19200, B19200},
+    {38400, B38400},
+    {57600, B57600},
+    {115200, B115200},
+#ifdef B230400
+    {230400, B230400},
+#endif
+#ifdef B460800
+    {460800, B460800},
+#endif
+#ifdef B921600
+    {921600, B921600},
+#endif
+};
 
 struct picc_data {
     char *e_rapdu;
     char *line;
     size_t linemax;
     FILE *fd;
+    /* raw input from the device in binary mode, which may contain a
+     * partial frame */
+    char *rx;
+    size_t rx_len;
+    size_t rx_max;
 };
 static int picc_encode_rapdu(const unsigned char *inbuf, size_t inlen,
         char **outbuf, size_t *outlen);
 static int picc_decode_apdu(const char *inbuf, size_t inlen,
         unsigned char **outbuf, size_t *outlen);
-static void un_braindead_ify_device(int fd);
+static int picc_encode_frame(const unsigned char *inbuf, size_t inlen,
+        char **outbuf, size_t *outlen);
+static int picc_decode_frame(const unsigned char *inbuf, size_t inlen,
+        unsigned char **outbuf, size_t *outlen);
+static int un_braindead_ify_device(int fd);
 
 
 int picc_encode_rapdu(const unsigned char *inbuf, size_t inlen,
         char **outbuf, size_t *outlen)
 {
     char *p;
-    const unsigned char *next;
     size_t length;
 
     if (!inbuf || inlen > 0xffff || !outbuf)
@@ -61,17 +102,12 @@ int picc_encode_rapdu(const unsigned char *inbuf, size_t inlen,
     *outlen = length;
 
     /* write length of R-APDU */
-    sprintf(p, "%0lX:", (unsigned long) inlen);
+    sprintf(p, "%04lX:", (unsigned long) inlen);
 
-    /* next points to the next byte to encode */
-    next = inbuf;
-    /* let p point behind ':' to write hex encoded bytes */
+    /* write hex encoded bytes behind ':' */
     p += 5;
-    while (inbuf+inlen > next) {
-        sprintf(p, " %02X", *next);
-        next++;
-        p += 3;
-    }
+    p += hex_encode(p, inbuf, inlen);
+    *p = '\0';
 
     return 1;
 }
@@ -79,10 +115,10 @@ int picc_encode_rapdu(const unsigned char *inbuf, size_t inlen,
 int picc_decode_apdu(const char *inbuf, size_t inlen,
         unsigned char **outbuf, size_t *outlen)
 {
-    size_t pos, length;
+    size_t length;
+    ssize_t decoded;
     char *end;
     unsigned char *p;
-    unsigned long int b;
 
     if (!outbuf || !outlen) {
         return 0;
@@ -111,51 +147,251 @@ int picc_decode_apdu(const char *inbuf, size_t inlen,
         *outbuf = p;
     }
 
-    pos = 0;
-    while(inbuf+inlen > end && length > pos) {
-        b = strtoul(end, &end, 16);
-        if (b > 0xff) {
-            RELAY_ERROR("Error decoding C-APDU\n");
-            return 0;
-        }
+    decoded = hex_decode(*outbuf, length, end, inbuf+inlen - end);
+    if (decoded < 0) {
+        RELAY_ERROR("Error decoding C-APDU\n");
+        return 0;
+    }
+    /* missing bytes are zero */
+    if ((size_t) decoded < length)
+        memset(*outbuf + decoded, 0, length - decoded);
 
-        p[pos++] = b;
+    *outlen = length;
+
+    return 1;
+}
+
+/* CRC_A of ISO/IEC 14443-3 */
+static unsigned short picc_crc(const unsigned char *buf, size_t len)
+{
+    unsigned short crc = 0x6363;
+    unsigned char b;
+
+    while (len--) {
+        b = *buf++ ^ (crc & 0xff);
+        b ^= b << 4;
+        crc = (crc >> 8) ^ (b << 8) ^ (b << 3) ^ (b >> 4);
     }
 
+    return crc;
+}
+
+int picc_encode_frame(const unsigned char *inbuf, size_t inlen,
+        char **outbuf, size_t *outlen)
+{
+    unsigned char *p;
+    unsigned short crc;
+
+    if (!inbuf || inlen > 0xffff || !outbuf || !outlen)
+        return 0;
+
+    p = realloc(*outbuf, inlen + PICC_FRAME_OVERHEAD);
+    if (!p) {
+        RELAY_ERROR("Error allocating memory for encoded R-APDU\n");
+        return 0;
+    }
+    *outbuf = (char *) p;
+    *outlen = inlen + PICC_FRAME_OVERHEAD;
+
+    /* length in big endian, then the APDU and CRC_A in little endian as
+     * transmitted by ISO/IEC 14443 */
+    p[0] = inlen >> 8;
+    p[1] = inlen & 0xff;
+    memcpy(p + 2, inbuf, inlen);
+    crc = picc_crc(p, 2 + inlen);
+    p[2 + inlen] = crc & 0xff;
+    p[3 + inlen] = crc >> 8;
+
+    return 1;
+}
+
+int picc_decode_frame(const unsigned char *inbuf, size_t inlen,
+        unsigned char **outbuf, size_t *outlen)
+{
+    size_t length;
+    unsigned short crc;
+    unsigned char *p;
+
+    if (!inbuf || inlen < PICC_FRAME_OVERHEAD || !outbuf || !outlen)
+        return 0;
+
+    length = (inbuf[0] << 8) | inbuf[1];
+    if (length + PICC_FRAME_OVERHEAD != inlen)
+        return 0;
+
+    crc = inbuf[2 + length] | (inbuf[3 + length] << 8);
+    if (crc != picc_crc(inbuf, 2 + length)) {
+        /* ignore the corrupted C-APDU so that the reader retransmits it */
+        RELAY_ERROR("CRC error in C-APDU\n");
+        *outlen = 0;
+        return 1;
+    }
+
+    if (length != 0) {
+        p = realloc(*outbuf, length);
+        if (!p) {
+            RELAY_ERROR("Error allocating memory for decoded C-APDU\n");
+            return 0;
+        }
+        memcpy(p, inbuf + 2, length);
+        *outbuf = p;
+    }
     *outlen = length;
 
     return 1;
 }
 
-void un_braindead_ify_device(int fd)
+int un_braindead_ify_device(int fd)
 {
     /* For some stupid reason the default setting for a serial console is to
      * use XON/XOFF. This means that some of the bytes will be dropped, making
      * the device completely unusable for a binary protocol.  Remove that
      * setting */
     struct termios options;
+    size_t i;
+
+    for (i = 0; i < sizeof picc_speeds/sizeof *picc_speeds; i++) {
+        if (picc_speeds[i].baudrate == piccbaudrate)
+            break;
+    }
+    if (i >= sizeof picc_speeds/sizeof *picc_speeds) {
+        RELAY_ERROR("Unsupported baud rate %u\n", piccbaudrate);
+        return 0;
+    }
 
     tcgetattr (fd, &options);
 
     options.c_lflag = 0;
     options.c_iflag &= IGNPAR | IGNBRK;
     options.c_oflag &= IGNPAR | IGNBRK;
+    /* block until at least one byte is available */
+    options.c_cc[VMIN] = 1;
+    options.c_cc[VTIME] = 0;
 
-    cfsetispeed (&options, B115200);
-    cfsetospeed (&options, B115200);
+    cfsetispeed (&options, picc_speeds[i].speed);
+    cfsetospeed (&options, picc_speeds[i].speed);
 
     if (tcsetattr (fd, TCSANOW, &options))
         RELAY_ERROR("Can't set device attributes");
+
+    return 1;
+}
+
+/* Reads what is available from the device, blocking until at least one byte
+ * was read. Returns the number of bytes read, 0 if reading was interrupted or
+ * -1 on error. */
+static ssize_t picc_read(struct picc_data *data)
+{
+    char *p;
+    ssize_t r;
+
+    if (data->rx_max - data->rx_len < PICC_READ_SIZE) {
+        p = realloc(data->rx, data->rx_len + PICC_READ_SIZE);
+        if (!p) {
+            RELAY_ERROR("Error allocating memory for C-APDU\n");
+            return -1;
+        }
+        data->rx = p;
+        data->rx_max = data->rx_len + PICC_READ_SIZE;
+    }
+
+    /* We bypass the buffer of data->fd, which is only used for reading lines
+     * with getline. */
+    r = read(fileno(data->fd), data->rx + data->rx_len, PICC_READ_SIZE);
+    if (r <= 0) {
+        if (r < 0 && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        RELAY_ERROR("Error reading from %s: %s\n", PICCDEV,
+                r < 0 ? strerror(errno) : "end of file");
+        return -1;
+    }
+    data->rx_len += r;
+
+    return r;
 }
 
+/* Waits for input from the device. Returns 0 if nothing arrived within
+ * PICC_FRAME_TIMEOUT_MS, otherwise 1 and reading reports any errors. */
+static int picc_wait_rx(struct picc_data *data)
+{
+    fd_set rfds;
+    struct timeval tv;
+
+    FD_ZERO(&rfds);
+    FD_SET(fileno(data->fd), &rfds);
+    tv.tv_sec = 0;
+    tv.tv_usec = PICC_FRAME_TIMEOUT_MS*1000;
 
-static int picc_connect(driver_data_t **driver_data)
+    return select(fileno(data->fd)+1, &rfds, NULL, NULL, &tv) != 0;
+}
+
+/* returns the length of the first complete frame in the input or 0 */
+static size_t picc_frame_len(const struct picc_data *data)
+{
+    const unsigned char *rx = (const unsigned char *) data->rx;
+    size_t len;
+
+    if (data->rx_len < 2)
+        return 0;
+
+    len = ((rx[0] << 8) | rx[1]) + PICC_FRAME_OVERHEAD;
+
+    return data->rx_len >= len ? len : 0;
+}
+
+/* decodes the C-APDU of the first complete frame in the input */
+static int picc_decode_rx(struct picc_data *data,
+        unsigned char **capdu, size_t *len)
+{
+    size_t framelen;
+
+    *len = 0;
+
+    framelen = picc_frame_len(data);
+    if (!framelen)
+        return 1;
+    if (!picc_decode_frame((unsigned char *) data->rx, framelen, capdu, len))
+        return 0;
+    data->rx_len -= framelen;
+    memmove(data->rx, data->rx + framelen, data->rx_len);
+
+    return 1;
+}
+
+/* writes the whole buffer without stdio */
+static int picc_write(struct picc_data *data, const char *buf, size_t len)
+{
+    ssize_t r;
+
+    while (len) {
+        r = write(fileno(data->fd), buf, len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            RELAY_ERROR("Error writing to %s: %s\n", PICCDEV, strerror(errno));
+            return 0;
+        }
+        buf += r;
+        len -= r;
+    }
+
+    return 1;
+}
+
+
+static int picc_connect(driver_data_t **driver_data, unsigned int session)
 {
     struct picc_data *data;
 
     if (!driver_data)
         return 0;
 
+    if (session) {
+        /* there is only one OpenPICC device */
+        RELAY_ERROR("OpenPICC supports only one session\n");
+        return 0;
+    }
+
 
     data = realloc(*driver_data, sizeof *data);
     if (!data)
@@ -165,13 +401,43 @@ static int picc_connect(driver_data_t **driver_data)
     data->e_rapdu = NULL;
     data->line = NULL;
     data->linemax = 0;
+    data->rx = NULL;
+    data->rx_len = 0;
+    data->rx_max = 0;
 
     data->fd = fopen(PICCDEV, "a+"); /*O_NOCTTY ?*/
     if (!data->fd) {
         RELAY_ERROR("Error opening %s: %s\n", PICCDEV, strerror(errno));
         return 0;
     }
-    un_braindead_ify_device(fileno(data->fd));
+    if (!un_braindead_ify_device(fileno(data->fd)))
+        return 0;
+
+
+    PRINTF("Connected to %s\n", PICCDEV);
+
+    return 1;
+}
+
+static int picc_reconnect(driver_data_t *driver_data)
+{
+    struct picc_data *data = driver_data;
+
+    if (!data)
+        return 0;
+
+    /* reopen the device with the same stream and buffers */
+    data->rx_len = 0;
+    if (data->fd)
+        data->fd = freopen(PICCDEV, "a+", data->fd);
+    else
+        data->fd = fopen(PICCDEV, "a+");
+    if (!data->fd) {
+        RELAY_ERROR("Error opening %s: %s\n", PICCDEV, strerror(errno));
+        return 0;
+    }
+    if (!un_braindead_ify_device(fileno(data->fd)))
+        return 0;
 
 
     PRINTF("Connected to %s\n", PICCDEV);
@@ -189,6 +455,7 @@ static int picc_disconnect(driver_data_t *driver_data)
             fclose(data->fd); 
         free(data->e_rapdu);
         free(data->line);
+        free(data->rx);
         free(data);
     }
 
@@ -206,6 +473,24 @@ static int picc_receive_capdu(driver_data_t *driver_data,
         return 0;
 
 
+    if (piccbinary) {
+        /* read C-APDU */
+        while (!picc_frame_len(data)) {
+            if (data->rx_len && !picc_wait_rx(data)) {
+                /* resynchronize with the start of the next frame */
+                RELAY_ERROR("Discarding incomplete frame of %lu bytes\n",
+                        (unsigned long) data->rx_len);
+                data->rx_len = 0;
+            }
+            if (picc_read(data) < 0)
+                return 0;
+        }
+
+        /* decode C-APDU */
+        return picc_decode_rx(data, capdu, len);
+    }
+
+
     /* read C-APDU */
     linelen = getline(&data->line, &data->linemax, data->fd);
     if (linelen <= 0) {
@@ -238,6 +523,16 @@ static int picc_send_rapdu(driver_data_t *driver_data,
         return 0;
 
 
+    if (piccbinary) {
+        /* encode and write R-APDU */
+        if (!picc_encode_frame(rapdu, len, &data->e_rapdu, &buflen))
+            return 0;
+        DEBUG("INF: Writing R-APDU frame of %lu bytes\n",
+                (unsigned long) buflen);
+        return picc_write(data, data->e_rapdu, buflen);
+    }
+
+
     /* encode R-APDU */
     if (!picc_encode_rapdu(rapdu, len, &data->e_rapdu, &buflen))
         return 0;
@@ -270,13 +565,16 @@ static int picc_receive_capdu(driver_data_t *driver_data,
 { OPICCERR; return 0; }
 static int picc_disconnect(driver_data_t *driver_data)
 { OPICCERR; return 0; }
-static int picc_connect(driver_data_t **driver_data)
+static int picc_connect(driver_data_t **driver_data, unsigned int session)
+{ OPICCERR; return 0; }
+static int picc_reconnect(driver_data_t *driver_data)
 { OPICCERR; return 0; }
 
 
 #endif
 struct rf_driver driver_openpicc = {
     .connect = picc_connect,
+    .reconnect = picc_reconnect,
     .disconnect = picc_disconnect,
     .receive_capdu = picc_receive_capdu,
     .send_rapdu = picc_send_rapdu,
@@ -17,6 +17,10 @@
  * You should have received a copy of the GNU General Public License along with
  * pcsc-relay.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -26,11 +30,24 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "apdulog.h"
 #include "cmdline.h"
+#include "hex.h"
+#include "lock.h"
 #include "pcsc-relay.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+/* multiplex the sessions in one thread if the drivers allow it */
+#define EVENT_LOOP
+#endif
+#endif
+
 #ifndef MAX_BUFFER_SIZE
 /** Maximum Tx/Rx Buffer for short APDU */
 #define MAX_BUFFER_SIZE 261
@@ -41,13 +58,68 @@
 #define MAX_EXT_BUFFER_SIZE 65538
 #endif
 
+/* delays in milliseconds between attempts to reconnect to the emulator */
+#define RECONNECT_DELAY_MIN 5
+#define RECONNECT_DELAY_MAX 10000
+
+enum session_state {
+    /* connecting in a separate thread */
+    SESSION_CONNECTING,
+    /* waiting for the emulator's C-APDU */
+    SESSION_CAPDU,
+    /* waiting for the card's R-APDU */
+    SESSION_RAPDU,
+    /* waiting for the card's R-APDU to a prefetched C-APDU, which the
+     * emulator didn't send */
+    SESSION_DISCARD,
+    SESSION_CLOSED,
+};
+
+/* state of a relay between one emulator and one card */
+struct session {
+    unsigned int number;
+    driver_data_t *rfdriver_data;
+    driver_data_t *scdriver_data;
+    unsigned char *buf;
+    size_t buflen;
+    unsigned char outputBuffer[MAX_EXT_BUFFER_SIZE];
+    size_t outputLength;
+    /* C-APDU that was answered with the R-APDU in outputBuffer */
+    unsigned char lastCapdu[MAX_EXT_BUFFER_SIZE];
+    size_t lastCapduLength;
+    /* whether the emulator was reconnected after the last R-APDU */
+    int replay;
+    /* C-APDU that was sent to the card ahead of the emulator, its R-APDU has
+     * not been received yet */
+    unsigned char prefetchCapdu[4+3];
+    size_t prefetchCapduLength;
+    char c_label[32];
+    char r_label[32];
+    /* only used by the event loop, protected by sessions_lock */
+    enum session_state state;
+    /* whether only the emulator needs to be reconnected */
+    int reconnect;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+#endif
+};
+
 int verbose = 0;
 static struct rf_driver *rfdriver = &driver_openpicc;
-static driver_data_t *rfdriver_data = NULL;
 static struct sc_driver *scdriver = &driver_pcsc;
-static driver_data_t *scdriver_data = NULL;
-static unsigned char *buf = NULL;
-static size_t buflen = 0;
+static struct session *sessions = NULL;
+static unsigned int session_count = 0;
+/* whether likely C-APDUs are sent to the card ahead of the emulator */
+static int prefetch = 0;
+/* whether the sessions are running in their own threads */
+static int threaded = 0;
+/* serializes the output of concurrent sessions */
+static void *output_lock = NULL;
+#ifdef EVENT_LOOP
+static void *sessions_lock = NULL;
+/* wakes up the event loop when a session has connected */
+static int wakeup[2] = {-1, -1};
+#endif
 
 /* Forward declaration */
 static void daemonize(void);
@@ -106,41 +178,645 @@ void daemonize(void)
 
 
 void cleanup_exit(int signo){
-    cleanup();
+    /* Joining the log's thread might never return, e.g. if stdout is
+     * blocked. Don't touch anything else in this case. */
+    if (!apdulog_abort())
+        _exit(0);
+    /* The threads of the sessions may still be using their drivers. The
+     * operating system closes the devices and connections in this case. */
+    if (!threaded)
+        cleanup();
     exit(0);
 }
 
+static void session_cleanup(struct session *session)
+{
+    rfdriver->disconnect(session->rfdriver_data);
+    session->rfdriver_data = NULL;
+    scdriver->disconnect(session->scdriver_data);
+    session->scdriver_data = NULL;
+    free(session->buf);
+    session->buf = NULL;
+    session->buflen = 0;
+    session->prefetchCapduLength = 0;
+}
+
 void cleanup(void) {
-    rfdriver->disconnect(rfdriver_data);
-    rfdriver_data = NULL;
-    scdriver->disconnect(scdriver_data);
-    scdriver_data = NULL;
-    free(buf);
+    unsigned int i;
+
+    apdulog_stop();
+    for (i = 0; i < session_count; i++)
+        session_cleanup(&sessions[i]);
+    free(sessions);
+    sessions = NULL;
+    session_count = 0;
+    free_lock(output_lock);
+    output_lock = NULL;
 }
 
 void
 hexdump(const char *label, unsigned char *buf, size_t len)
 {
-    size_t i = 0;
+    /* enough for short APDUs */
+    char stack_out[1024];
+    char *out = stack_out;
+    size_t label_len, out_len;
+
     if (verbose >= LEVEL_NORMAL) {
-        printf("%s", label);
-        while (i < len) {
-            printf("%02X", buf[i]);
-            i++;
-            if (i%20)
-                printf(" ");
-            else if (i != len)
-                printf("\n");
+        label_len = strlen(label);
+        out_len = label_len + HEX_DUMP_SIZE(len);
+        if (out_len > sizeof stack_out) {
+            out = malloc(out_len);
+            if (!out)
+                return;
+        }
+
+        /* format everything and write it at once */
+        memcpy(out, label, label_len);
+        out_len = label_len + hex_dump(out + label_len, buf, len);
+
+        if (output_lock)
+            lock(output_lock);
+        fwrite(out, 1, out_len, stdout);
+        if (output_lock)
+            unlock(output_lock);
+
+        if (out != stack_out)
+            free(out);
+    }
+}
+
+static int session_connect(struct session *session)
+{
+    /* connect to reader and card */
+    if (!scdriver->connect(&session->scdriver_data, session->number))
+        return 0;
+
+    /* Open the device */
+    if (!rfdriver->connect(&session->rfdriver_data, session->number))
+        return 0;
+
+    return 1;
+}
+
+static void delay(unsigned long ms)
+{
+    if (ms >= 1000)
+        sleep(ms / 1000);
+    usleep((ms % 1000) * 1000);
+}
+
+/* Reconnects the emulator, retrying with an exponential backoff. The card is
+ * kept connected meanwhile. */
+static void session_reconnect_rf(struct session *session)
+{
+    unsigned long backoff = RECONNECT_DELAY_MIN;
+
+    INFO("Trying to recover by reconnecting to emulator\n");
+    while (!rfdriver->reconnect(session->rfdriver_data)) {
+        /* randomize the delay so that sessions don't retry in lockstep */
+        delay(backoff/2 + rand() % (backoff/2 + 1));
+        backoff *= 2;
+        if (backoff > RECONNECT_DELAY_MAX)
+            backoff = RECONNECT_DELAY_MAX;
+        INFO("Trying to recover by reconnecting to emulator\n");
+    }
+
+    /* the emulator may have missed the last R-APDU */
+    session->replay = session->lastCapduLength > 0;
+}
+
+/* remembers the C-APDU that was answered with the R-APDU in outputBuffer */
+static void session_remember_capdu(struct session *session)
+{
+    if (session->buflen <= sizeof session->lastCapdu) {
+        memcpy(session->lastCapdu, session->buf, session->buflen);
+        session->lastCapduLength = session->buflen;
+    } else {
+        session->lastCapduLength = 0;
+    }
+}
+
+/* Returns 1 if the first C-APDU after reconnecting the emulator repeats the
+ * last one, whose R-APDU can be replayed without asking the card again. */
+static int session_is_retransmission(struct session *session)
+{
+    int r = session->replay
+        && session->buflen == session->lastCapduLength
+        && memcmp(session->buf, session->lastCapdu, session->buflen) == 0;
+
+    session->replay = 0;
+    if (r)
+        INFO("Replaying R-APDU for retransmitted C-APDU\n");
+
+    return r;
+}
+
+/* Predicts the C-APDU following the one in buf, which was answered with the
+ * R-APDU in outputBuffer: reading on after a completely satisfied READ
+ * BINARY, which doesn't change the card's state. GET RESPONSE is not
+ * predicted, because a card discards its pending response if a different
+ * command follows. Commands with secure messaging are not predicted either.
+ * Returns the length of the predicted C-APDU or 0. */
+static size_t session_predict_capdu(const struct session *session,
+        unsigned char *capdu)
+{
+    const unsigned char *c = session->buf;
+    const unsigned char *r = session->outputBuffer;
+    size_t le, rlen = session->outputLength;
+    unsigned long offset;
+
+    if (session->buflen < 4 || rlen < 2)
+        return 0;
+
+    if ((c[0] & 0xFC) != 0 || c[1] != 0xB0
+            || r[rlen-2] != 0x90 || r[rlen-1] != 0x00)
+        return 0;
+
+    if (session->buflen == 5) {
+        le = c[4] ? c[4] : 0x100;
+    } else if (session->buflen == 7 && c[4] == 0) {
+        le = (c[5] << 8) | c[6];
+        if (!le)
+            le = 0x10000;
+    } else {
+        return 0;
+    }
+    if (rlen - 2 != le)
+        /* end of file */
+        return 0;
+
+    if (c[2] & 0x80)
+        /* short EF identifier in P1, offset in P2 */
+        offset = c[3];
+    else
+        offset = (c[2] << 8) | c[3];
+    offset += le;
+    if (offset > 0x7FFF)
+        return 0;
+
+    capdu[0] = c[0];
+    capdu[1] = 0xB0;
+    capdu[2] = offset >> 8;
+    capdu[3] = offset & 0xFF;
+    memcpy(capdu + 4, c + 4, session->buflen - 4);
+
+    return session->buflen;
+}
+
+/* Sends the predicted C-APDU to the card, whose R-APDU is then received while
+ * the current R-APDU is sent to the emulator */
+static void session_prefetch(struct session *session)
+{
+    size_t len;
+
+    if (!prefetch || session->prefetchCapduLength)
+        return;
+
+    len = session_predict_capdu(session, session->prefetchCapdu);
+    /* an error of the card is reported with the next C-APDU */
+    if (len && scdriver->send_capdu(session->scdriver_data,
+                session->prefetchCapdu, len))
+        session->prefetchCapduLength = len;
+}
+
+/* Returns 1 if the C-APDU has been prefetched. Otherwise, the prefetched
+ * R-APDU needs to be discarded. */
+static int session_prefetch_hit(struct session *session)
+{
+    int r = session->buflen == session->prefetchCapduLength
+        && memcmp(session->buf, session->prefetchCapdu, session->buflen) == 0;
+
+    session->prefetchCapduLength = 0;
+    if (r) {
+        DEBUG("Using prefetched R-APDU\n");
+    } else {
+        /* outputBuffer can't be replayed anymore */
+        session->lastCapduLength = 0;
+        DEBUG("Discarding prefetched R-APDU\n");
+    }
+
+    return r;
+}
+
+#ifdef EVENT_LOOP
+/* waits for the card's R-APDU to a C-APDU sent with send_capdu */
+static int session_receive_rapdu(struct session *session)
+{
+    struct pollfd pfd;
+
+    while (1) {
+        session->outputLength = sizeof session->outputBuffer;
+        if (!scdriver->receive_rapdu_nb(session->scdriver_data,
+                    session->outputBuffer, &session->outputLength))
+            return 0;
+        if (session->outputLength)
+            return 1;
+
+        pfd.fd = scdriver->get_fd(session->scdriver_data);
+        pfd.events = POLLIN;
+        if (pfd.fd < 0 || (poll(&pfd, 1, -1) < 0 && errno != EINTR))
+            return 0;
+    }
+}
+#else
+static int session_receive_rapdu(struct session *session)
+{
+    return 0;
+}
+#endif
+
+/* transmits the C-APDU in buf to the card, unless it has been prefetched */
+static int session_transmit(struct session *session)
+{
+    if (session->prefetchCapduLength) {
+        if (session_prefetch_hit(session))
+            return session_receive_rapdu(session);
+        if (!session_receive_rapdu(session))
+            return 0;
+    }
+
+    session->outputLength = sizeof session->outputBuffer;
+    return scdriver->transmit(session->scdriver_data, session->buf,
+            session->buflen, session->outputBuffer, &session->outputLength);
+}
+
+/* relays APDUs until the card fails */
+static void session_relay(struct session *session)
+{
+    while(1) {
+        /* get C-APDU */
+        if (!rfdriver->receive_capdu(session->rfdriver_data, &session->buf,
+                    &session->buflen)) {
+            session_reconnect_rf(session);
+            /* buf still holds the last C-APDU, wait for the emulator's */
+            session->buflen = 0;
+            continue;
+        }
+        if (!session->buflen || !session->buf)
+            continue;
+
+        apdulog(session->number, APDULOG_CAPDU, session->c_label,
+                session->buf, session->buflen);
+
+
+        if (!session_is_retransmission(session)) {
+            /* transmit APDU to card */
+            if (!session_transmit(session))
+                break;
+            session_remember_capdu(session);
+        }
+
+
+        /* send R-APDU */
+        apdulog(session->number, APDULOG_RAPDU, session->r_label,
+            session->outputBuffer, session->outputLength);
+
+        session_prefetch(session);
+
+        if (!rfdriver->send_rapdu(session->rfdriver_data,
+                    session->outputBuffer, session->outputLength))
+            session_reconnect_rf(session);
+    }
+}
+
+#ifdef EVENT_LOOP
+static void set_state(struct session *session, enum session_state state)
+{
+    char c = 0;
+
+    lock(sessions_lock);
+    session->state = state;
+    unlock(sessions_lock);
+
+    if (write(wakeup[1], &c, sizeof c) < 0) {
+        /* the pipe is full, so the event loop will wake up anyway */
+    }
+}
+
+/* connects the session or reconnects its emulator, which may block */
+static void *connect_thread(void *arg)
+{
+    struct session *session = arg;
+
+    if (session->reconnect) {
+        session_reconnect_rf(session);
+    } else if (!session_connect(session)) {
+        RELAY_ERROR("Could not start session %u\n", session->number);
+        session_cleanup(session);
+        set_state(session, SESSION_CLOSED);
+        return NULL;
+    }
+
+    set_state(session, SESSION_CAPDU);
+
+    return NULL;
+}
+
+static void start_connect(struct session *session, int reconnect)
+{
+    pthread_attr_t attr;
+    int r = -1;
+
+    session->reconnect = reconnect;
+    set_state(session, SESSION_CONNECTING);
+
+    if (pthread_attr_init(&attr) == 0) {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        r = pthread_create(&session->thread, &attr, connect_thread, session);
+        pthread_attr_destroy(&attr);
+    }
+    if (r != 0) {
+        RELAY_ERROR("Could not create thread for session %u\n",
+                session->number);
+        session_cleanup(session);
+        set_state(session, SESSION_CLOSED);
+    }
+}
+
+/* sends the C-APDU in buf to the card */
+static int session_step_capdu(struct session *session)
+{
+    if (!scdriver->send_capdu(session->scdriver_data,
+                session->buf, session->buflen)) {
+        session_cleanup(session);
+        set_state(session, SESSION_CLOSED);
+        return 0;
+    }
+    session->state = SESSION_RAPDU;
+
+    return 1;
+}
+
+/* sends the R-APDU in outputBuffer to the emulator */
+static int session_step_rapdu(struct session *session)
+{
+    apdulog(session->number, APDULOG_RAPDU, session->r_label,
+            session->outputBuffer, session->outputLength);
+
+    session_prefetch(session);
+
+    if (!rfdriver->send_rapdu(session->rfdriver_data,
+                session->outputBuffer, session->outputLength)) {
+        start_connect(session, 1);
+        return 0;
+    }
+    session->state = SESSION_CAPDU;
+
+    return 1;
+}
+
+/* advances the session as far as possible without blocking */
+static void session_step(struct session *session)
+{
+    while (1) {
+        switch (session->state) {
+            case SESSION_CAPDU:
+                /* get C-APDU */
+                if (!rfdriver->receive_capdu_nb(session->rfdriver_data,
+                            &session->buf, &session->buflen)) {
+                    session->buflen = 0;
+                    start_connect(session, 1);
+                    return;
+                }
+                if (!session->buflen || !session->buf)
+                    return;
+
+                apdulog(session->number, APDULOG_CAPDU, session->c_label,
+                session->buf, session->buflen);
+
+                if (session_is_retransmission(session)) {
+                    if (!session_step_rapdu(session))
+                        return;
+                    break;
+                }
+
+                if (session->prefetchCapduLength) {
+                    /* the card is already working on a C-APDU */
+                    session->state = session_prefetch_hit(session)
+                        ? SESSION_RAPDU : SESSION_DISCARD;
+                    break;
+                }
+
+                /* transmit APDU to card */
+                if (!session_step_capdu(session))
+                    return;
+                break;
+
+            case SESSION_DISCARD:
+                session->outputLength = sizeof session->outputBuffer;
+                if (!scdriver->receive_rapdu_nb(session->scdriver_data,
+                            session->outputBuffer, &session->outputLength)) {
+                    session_cleanup(session);
+                    set_state(session, SESSION_CLOSED);
+                    return;
+                }
+                if (!session->outputLength)
+                    return;
+
+                /* transmit APDU to card */
+                if (!session_step_capdu(session))
+                    return;
+                break;
+
+            case SESSION_RAPDU:
+                session->outputLength = sizeof session->outputBuffer;
+                if (!scdriver->receive_rapdu_nb(session->scdriver_data,
+                            session->outputBuffer, &session->outputLength)) {
+                    session_cleanup(session);
+                    set_state(session, SESSION_CLOSED);
+                    return;
+                }
+                if (!session->outputLength)
+                    return;
+                session_remember_capdu(session);
+
+                /* send R-APDU */
+                if (!session_step_rapdu(session))
+                    return;
+                break;
+
+            default:
+                return;
+        }
+    }
+}
+
+/* Relays all sessions in the calling thread. Only connecting, which may
+ * block, is done in separate threads. Returns when all of them have ended, so
+ * that the sessions may be freed afterwards. */
+static int run_event_loop(void)
+{
+    struct pollfd *fds = NULL;
+    struct session **polled = NULL;
+    unsigned int i, n, active;
+    sigset_t mask, old_mask;
+    int timeout, fd, r = 0, failed = 0;
+    char c;
+
+    fds = malloc((session_count + 1) * sizeof *fds);
+    polled = malloc(session_count * sizeof *polled);
+    sessions_lock = create_lock();
+    if (!fds || !polled || !sessions_lock || pipe(wakeup) != 0
+            || fcntl(wakeup[0], F_SETFL, O_NONBLOCK) != 0
+            || fcntl(wakeup[1], F_SETFL, O_NONBLOCK) != 0) {
+        RELAY_ERROR("Could not initialize event loop\n");
+        goto err;
+    }
+
+    /* signals are handled by the main thread only */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &mask, &old_mask) != 0)
+        goto err;
+    threaded = 1;
+    for (i = 0; i < session_count; i++)
+        start_connect(&sessions[i], 0);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    while (1) {
+        n = 0;
+        active = 0;
+        timeout = -1;
+        lock(sessions_lock);
+        for (i = 0; i < session_count; i++) {
+            switch (sessions[i].state) {
+                case SESSION_CONNECTING:
+                    active++;
+                    break;
+                case SESSION_CAPDU:
+                case SESSION_RAPDU:
+                case SESSION_DISCARD:
+                    if (failed)
+                        /* only wait for the connect threads */
+                        break;
+                    active++;
+                    fd = sessions[i].state == SESSION_CAPDU
+                        ? rfdriver->get_fd(sessions[i].rfdriver_data)
+                        : scdriver->get_fd(sessions[i].scdriver_data);
+                    if (fd < 0)
+                        /* let the driver report its error right away */
+                        timeout = 0;
+                    fds[n].fd = fd;
+                    fds[n].events = POLLIN;
+                    fds[n].revents = 0;
+                    polled[n] = &sessions[i];
+                    n++;
+                    break;
+                default:
+                    break;
+            }
+        }
+        unlock(sessions_lock);
+
+        if (!active)
+            break;
+
+        fds[n].fd = wakeup[0];
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        if (poll(fds, n + 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (failed) {
+                /* don't spin while the connect threads finish */
+                sleep(1);
+                continue;
+            }
+            RELAY_ERROR("poll: %s\n", strerror(errno));
+            /* The connect threads still use their sessions, which must not
+             * be freed before they have finished. */
+            failed = 1;
+            continue;
+        }
+
+        if (fds[n].revents)
+            while (read(wakeup[0], &c, sizeof c) > 0)
+                ;
+
+        for (i = 0; i < n; i++) {
+            if (fds[i].revents || fds[i].fd < 0)
+                session_step(polled[i]);
         }
-        printf("\n");
     }
+    threaded = 0;
+    r = !failed;
+
+err:
+    free_lock(sessions_lock);
+    sessions_lock = NULL;
+    if (wakeup[0] >= 0)
+        close(wakeup[0]);
+    if (wakeup[1] >= 0)
+        close(wakeup[1]);
+    wakeup[0] = wakeup[1] = -1;
+    free(polled);
+    free(fds);
+
+    return r;
 }
+#endif
+
+#ifdef HAVE_PTHREAD
+static void *session_thread(void *arg)
+{
+    struct session *session = arg;
+
+    if (session_connect(session))
+        session_relay(session);
+    else
+        RELAY_ERROR("Could not start session %u\n", session->number);
+
+    /* the other sessions keep on relaying */
+    session_cleanup(session);
+
+    return NULL;
+}
+
+static int run_threads(void)
+{
+    unsigned int i, started;
+    sigset_t mask, old_mask;
+    int r = 0;
+
+    /* signals are handled by the main thread only */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &mask, &old_mask) != 0)
+        return 0;
+
+    threaded = 1;
+    for (started = 0; started < session_count; started++) {
+        if (pthread_create(&sessions[started].thread, NULL, session_thread,
+                    &sessions[started]) != 0) {
+            RELAY_ERROR("Could not create thread for session %u\n", started);
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    for (i = 0; i < started; i++)
+        pthread_join(sessions[i].thread, NULL);
+    threaded = 0;
+
+    if (started == session_count)
+        r = 1;
+
+    return r;
+}
+#else
+static int run_threads(void)
+{
+    RELAY_ERROR("Multiple sessions require support for threads\n");
+    return 0;
+}
+#endif
 
 int main (int argc, char **argv)
 {
-    /*printf("%s:%d\n", __FILE__, __LINE__);*/
-    unsigned char outputBuffer[MAX_EXT_BUFFER_SIZE];
-    size_t outputLength;
+    unsigned int i;
 
     struct gengetopt_args_info args_info;
 
@@ -181,9 +857,43 @@ int main (int argc, char **argv)
         vicchostname = args_info.vicc_hostname_arg;
     if (args_info.vicc_atr_given)
         viccatr = args_info.vicc_atr_arg;
+    piccbinary = args_info.openpicc_framing_arg == openpicc_framing_arg_binary;
+    piccbaudrate = args_info.openpicc_baudrate_arg;
+    lnfcgetresponse = args_info.libnfc_get_response_flag;
+    if (args_info.sessions_arg < 1) {
+        RELAY_ERROR("Need at least one session\n");
+        exit(2);
+    }
 
     verbose = args_info.verbose_given;
 
+#ifdef EVENT_LOOP
+    /* the prefetched R-APDU is received with the non-blocking functions */
+    prefetch = args_info.prefetch_flag && scdriver->send_capdu;
+#endif
+    if (args_info.prefetch_flag && !prefetch)
+        RELAY_ERROR("Prefetching is not supported with this connector\n");
+
+    sessions = calloc(args_info.sessions_arg, sizeof *sessions);
+    output_lock = create_lock();
+    if (!sessions || !output_lock) {
+        RELAY_ERROR("Could not allocate memory for sessions\n");
+        goto err;
+    }
+    session_count = args_info.sessions_arg;
+    /* jitter for reconnecting */
+    srand(time(NULL) ^ getpid());
+    for (i = 0; i < session_count; i++) {
+        sessions[i].number = i;
+        if (session_count > 1) {
+            sprintf(sessions[i].c_label, "C-APDU %u:\n", i);
+            sprintf(sessions[i].r_label, "R-APDU %u:\n", i);
+        } else {
+            strcpy(sessions[i].c_label, "C-APDU:\n");
+            strcpy(sessions[i].r_label, "R-APDU:\n");
+        }
+    }
+
 #if HAVE_SIGACTION
     struct sigaction new_sig, old_sig;
 
@@ -199,54 +909,50 @@ int main (int argc, char **argv)
 #endif
 
 
-    /* connect to reader and card */
-    if (!scdriver->connect(&scdriver_data))
-        goto err;
-
-
-    /* Open the device */
-    if (!rfdriver->connect(&rfdriver_data))
+    /* open the capture before daemonize() changes the directory, the APDUs
+     * are printed only in the foreground */
+    if (!apdulog_open(args_info.foreground_flag && verbose >= LEVEL_NORMAL,
+                args_info.capture_given ? args_info.capture_arg : NULL,
+                session_count))
         goto err;
 
+    if (session_count == 1) {
+        if (!session_connect(&sessions[0]))
+            goto err;
 
-    if (!args_info.foreground_flag) {
-        INFO("Forking to background...\n");
-        verbose = -1;
-        daemonize();
-    }
-
-    cmdline_parser_free (&args_info);
-
-    while(1) {
-        /* get C-APDU */
-        if (!rfdriver->receive_capdu(rfdriver_data, &buf, &buflen)) {
-            do {
-                INFO("Trying to recover by reconnecting to emulator\n");
-                sleep(10);
-            } while (!rfdriver->connect(&rfdriver_data));
+        if (!args_info.foreground_flag) {
+            INFO("Forking to background...\n");
+            verbose = -1;
+            daemonize();
         }
-        if (!buflen || !buf)
-            continue;
 
-        hexdump("C-APDU:\n", buf, buflen);
+        if (!apdulog_start())
+            goto err;
 
+        cmdline_parser_free (&args_info);
+
+        session_relay(&sessions[0]);
+    } else {
+        /* The sessions connect in their own threads, because waiting for one
+         * emulator or card must not delay the others. Threads don't survive
+         * fork(), so we need to fork first. */
+        if (!args_info.foreground_flag) {
+            INFO("Forking to background...\n");
+            verbose = -1;
+            daemonize();
+        }
 
-        /* transmit APDU to card */
-        outputLength = sizeof outputBuffer;
-        if (!scdriver->transmit(scdriver_data, buf, buflen, outputBuffer,
-                    &outputLength))
+        if (!apdulog_start())
             goto err;
 
+        cmdline_parser_free (&args_info);
 
-        /* send R-APDU */
-        hexdump("R-APDU:\n", outputBuffer, outputLength);
-
-        if (!rfdriver->send_rapdu(rfdriver_data, outputBuffer, outputLength)) {
-            do {
-                INFO("Trying to recover by reconnecting to emulator\n");
-                sleep(10);
-            } while (!rfdriver->connect(&rfdriver_data));
-        }
+#ifdef EVENT_LOOP
+        if (rfdriver->get_fd && scdriver->get_fd)
+            run_event_loop();
+        else
+#endif
+            run_threads();
     }
 
 
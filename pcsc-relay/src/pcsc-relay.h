@@ -31,13 +31,29 @@ extern "C" {
 #endif
 
 typedef void driver_data_t;
+/* The session number selects the device, reader or port of a driver if
+ * multiple relay sessions are running, see the drivers for details. */
+/* The optional operations get_fd, receive_capdu_nb, send_capdu and
+ * receive_rapdu_nb allow multiplexing the sessions in one event loop. A
+ * driver either implements all of its optional operations or sets them to
+ * NULL. The non-blocking functions never wait for input. They return 0 on
+ * error. Otherwise, they set the length to 0 if the APDU is not yet complete.
+ * Then they should be called again when the driver's file descriptor becomes
+ * readable. */
 struct rf_driver {
-    int (*connect) (driver_data_t **driver_data);
+    int (*connect) (driver_data_t **driver_data, unsigned int session);
+    /* re-establishes a failed connection, reusing the resources allocated by
+     * connect */
+    int (*reconnect) (driver_data_t *driver_data);
     int (*disconnect) (driver_data_t *driver_data);
     int (*receive_capdu) (driver_data_t *driver_data,
             unsigned char **capdu, size_t *len);
     int (*send_rapdu) (driver_data_t *driver_data,
             const unsigned char *rapdu, size_t len);
+    /* file descriptor to poll for reading or -1 */
+    int (*get_fd) (driver_data_t *driver_data);
+    int (*receive_capdu_nb) (driver_data_t *driver_data,
+            unsigned char **capdu, size_t *len);
 };
 
 extern int verbose;
@@ -47,11 +63,19 @@ extern struct rf_driver driver_libnfc;
 extern struct rf_driver driver_vicc;
 
 struct sc_driver {
-    int (*connect) (driver_data_t **driver_data);
+    int (*connect) (driver_data_t **driver_data, unsigned int session);
     int (*disconnect) (driver_data_t *driver_data);
     int (*transmit) (driver_data_t *driver_data,
         const unsigned char *send, size_t send_len,
         unsigned char *recv, size_t *recv_len);
+    /* file descriptor to poll for reading or -1 */
+    int (*get_fd) (driver_data_t *driver_data);
+    /* starts transmitting the APDU, the response is fetched with
+     * receive_rapdu_nb */
+    int (*send_capdu) (driver_data_t *driver_data,
+        const unsigned char *send, size_t send_len);
+    int (*receive_rapdu_nb) (driver_data_t *driver_data,
+        unsigned char *recv, size_t *recv_len);
 };
 
 extern struct sc_driver driver_pcsc;
@@ -62,6 +86,9 @@ extern char *vpcdhostname;
 extern unsigned int viccport;
 extern char *vicchostname;
 extern char *viccatr;
+extern int piccbinary;
+extern unsigned int piccbaudrate;
+extern int lnfcgetresponse;
 
 void hexdump(const char *label, unsigned char *buf, size_t len);
 
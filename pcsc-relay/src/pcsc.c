@@ -45,12 +45,40 @@
 #define SHAREMODE SCARD_SHARE_EXCLUSIVE
 #define PREFERREDPROTOCOL SCARD_PROTOCOL_ANY
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+/* SCardTransmit blocks, so the non-blocking interface is realized with a
+ * thread that transmits the APDU and signals the response via a pipe */
+#define PCSC_WORKER
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+/* maximum size of an extended length R-APDU */
+#define PCSC_RAPDU_MAX 65538
+#endif
+
 
 struct pcsc_data {
     LPSTR readers;
     SCARDCONTEXT hContext;
     SCARDHANDLE hCard;
     DWORD dwActiveProtocol;
+#ifdef PCSC_WORKER
+    pthread_t worker;
+    int worker_started;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /* written by the worker when a response is ready */
+    int pipe[2];
+    /* the following is protected by mutex */
+    int stop;
+    int pending;
+    int done;
+    int result;
+    unsigned char *capdu;
+    size_t capdu_len;
+    unsigned char rapdu[PCSC_RAPDU_MAX];
+    size_t rapdu_len;
+#endif
 };
 
 
@@ -59,7 +87,7 @@ struct pcsc_data {
 unsigned int readernum = READERNUM_AUTODETECT;
 
 
-static int pcsc_connect(driver_data_t **driver_data)
+static int pcsc_connect(driver_data_t **driver_data, unsigned int session)
 {
     struct pcsc_data *data;
 
@@ -69,6 +97,8 @@ static int pcsc_connect(driver_data_t **driver_data)
     LPSTR readers = NULL;
     char *reader;
     size_t l, i;
+    /* readers with a card to skip when autodetecting */
+    unsigned int skip = session;
 
     if (!driver_data)
         return 0;
@@ -80,6 +110,13 @@ static int pcsc_connect(driver_data_t **driver_data)
     data->readers = NULL;
     data->hContext = 0;
     data->hCard = 0;
+#ifdef PCSC_WORKER
+    data->worker_started = 0;
+    data->pipe[0] = data->pipe[1] = -1;
+    data->stop = data->pending = data->done = 0;
+    data->capdu = NULL;
+    data->capdu_len = 0;
+#endif
     *driver_data = data;
 
 
@@ -112,10 +149,12 @@ static int pcsc_connect(driver_data_t **driver_data)
     }
     data->readers = readers;
 
+    /* session n uses the reader with the number readernum+n or, when
+     * autodetecting, the n-th reader with a card */
     for (reader = readers, i = 0; readerslen > 0;
             l = strlen(reader)+1, readerslen -= l, reader += l, i++) {
 
-        if (i == readernum || readernum == READERNUM_AUTODETECT) {
+        if (readernum == READERNUM_AUTODETECT || i == readernum + session) {
             state.szReader = reader;
             state.dwCurrentState = SCARD_STATE_UNAWARE;
 
@@ -125,10 +164,14 @@ static int pcsc_connect(driver_data_t **driver_data)
                 goto err;
             }
 
-            if (state.dwEventState & SCARD_STATE_PRESENT)
-                break;
+            if (state.dwEventState & SCARD_STATE_PRESENT) {
+                if (readernum != READERNUM_AUTODETECT || !skip)
+                    break;
+                skip--;
+                continue;
+            }
 
-            if (i == readernum) {
+            if (readernum != READERNUM_AUTODETECT) {
                 RELAY_ERROR("No card present in %s\n", reader);
                 goto err;
             }
@@ -139,7 +182,8 @@ static int pcsc_connect(driver_data_t **driver_data)
             RELAY_ERROR("Could not find a reader with a card\n");
             r = SCARD_E_NO_SMARTCARD;
         } else {
-            RELAY_ERROR("Could not find reader number %u\n", readernum);
+            RELAY_ERROR("Could not find reader number %u\n",
+                    readernum + session);
             r = SCARD_E_UNKNOWN_READER;
         }
         goto err;
@@ -169,6 +213,20 @@ static int pcsc_disconnect(driver_data_t *driver_data)
     struct pcsc_data *data = driver_data;
 
     if (data) {
+#ifdef PCSC_WORKER
+        if (data->worker_started) {
+            pthread_mutex_lock(&data->mutex);
+            data->stop = 1;
+            pthread_cond_signal(&data->cond);
+            pthread_mutex_unlock(&data->mutex);
+            pthread_join(data->worker, NULL);
+            pthread_cond_destroy(&data->cond);
+            pthread_mutex_destroy(&data->mutex);
+            close(data->pipe[0]);
+            close(data->pipe[1]);
+        }
+        free(data->capdu);
+#endif
         SCardDisconnect(data->hCard, SCARD_LEAVE_CARD);
 #ifdef SCARD_AUTOALLOCATE
         SCardFreeMemory(data->hContext, data->readers);
@@ -224,8 +282,165 @@ static int pcsc_transmit(driver_data_t *driver_data,
 }
 
 
+#ifdef PCSC_WORKER
+static void *pcsc_worker(void *arg)
+{
+    struct pcsc_data *data = arg;
+    size_t rapdu_len;
+    int result;
+    char c = 0;
+
+    pthread_mutex_lock(&data->mutex);
+    while (1) {
+        while (!data->stop && !data->pending)
+            pthread_cond_wait(&data->cond, &data->mutex);
+        if (data->stop)
+            break;
+
+        /* the C-APDU isn't touched until the response is done */
+        pthread_mutex_unlock(&data->mutex);
+        rapdu_len = sizeof data->rapdu;
+        result = pcsc_transmit(data, data->capdu, data->capdu_len,
+                data->rapdu, &rapdu_len);
+        pthread_mutex_lock(&data->mutex);
+
+        data->rapdu_len = rapdu_len;
+        data->result = result;
+        data->pending = 0;
+        data->done = 1;
+        if (write(data->pipe[1], &c, sizeof c) != sizeof c)
+            RELAY_ERROR("Could not signal response: %s\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&data->mutex);
+
+    return NULL;
+}
+
+static int pcsc_start_worker(struct pcsc_data *data)
+{
+    if (pipe(data->pipe) != 0) {
+        data->pipe[0] = data->pipe[1] = -1;
+        return 0;
+    }
+
+    if (pthread_mutex_init(&data->mutex, NULL) != 0)
+        goto err;
+    if (pthread_cond_init(&data->cond, NULL) != 0) {
+        pthread_mutex_destroy(&data->mutex);
+        goto err;
+    }
+    if (pthread_create(&data->worker, NULL, pcsc_worker, data) != 0) {
+        pthread_cond_destroy(&data->cond);
+        pthread_mutex_destroy(&data->mutex);
+        goto err;
+    }
+    data->worker_started = 1;
+
+    return 1;
+
+err:
+    close(data->pipe[0]);
+    close(data->pipe[1]);
+    data->pipe[0] = data->pipe[1] = -1;
+
+    return 0;
+}
+
+static int pcsc_get_fd(driver_data_t *driver_data)
+{
+    struct pcsc_data *data = driver_data;
+
+    if (!data || (!data->worker_started && !pcsc_start_worker(data)))
+        return -1;
+
+    return data->pipe[0];
+}
+
+static int pcsc_send_capdu(driver_data_t *driver_data,
+        const unsigned char *send, size_t send_len)
+{
+    struct pcsc_data *data = driver_data;
+    unsigned char *p;
+    int r = 0;
+
+    if (!data || (!data->worker_started && !pcsc_start_worker(data)))
+        return 0;
+
+    pthread_mutex_lock(&data->mutex);
+    if (data->pending || data->done) {
+        RELAY_ERROR("Previous response has not been fetched\n");
+        goto err;
+    }
+    if (send_len > data->capdu_len || !data->capdu) {
+        p = realloc(data->capdu, send_len);
+        if (!p) {
+            RELAY_ERROR("Error allocating memory for C-APDU\n");
+            goto err;
+        }
+        data->capdu = p;
+    }
+    memcpy(data->capdu, send, send_len);
+    data->capdu_len = send_len;
+    data->pending = 1;
+    pthread_cond_signal(&data->cond);
+    r = 1;
+
+err:
+    pthread_mutex_unlock(&data->mutex);
+
+    return r;
+}
+
+static int pcsc_receive_rapdu_nb(driver_data_t *driver_data,
+        unsigned char *recv, size_t *recv_len)
+{
+    struct pcsc_data *data = driver_data;
+    char c;
+    int r = 0;
+
+    if (!data || !data->worker_started)
+        return 0;
+
+    pthread_mutex_lock(&data->mutex);
+    if (!data->done) {
+        *recv_len = 0;
+        r = 1;
+        goto err;
+    }
+
+    /* the worker has written to the pipe before setting done */
+    if (read(data->pipe[0], &c, sizeof c) != sizeof c) {
+        RELAY_ERROR("Could not read signal of response: %s\n",
+                strerror(errno));
+        goto err;
+    }
+    data->done = 0;
+
+    if (!data->result)
+        goto err;
+    if (*recv_len < data->rapdu_len) {
+        RELAY_ERROR("Not enough memory for rapdu\n");
+        goto err;
+    }
+    memcpy(recv, data->rapdu, data->rapdu_len);
+    *recv_len = data->rapdu_len;
+    r = 1;
+
+err:
+    pthread_mutex_unlock(&data->mutex);
+
+    return r;
+}
+#endif
+
+
 struct sc_driver driver_pcsc = {
     .connect = pcsc_connect,
     .disconnect = pcsc_disconnect,
     .transmit = pcsc_transmit,
+#ifdef PCSC_WORKER
+    .get_fd = pcsc_get_fd,
+    .send_capdu = pcsc_send_capdu,
+    .receive_rapdu_nb = pcsc_receive_rapdu_nb,
+#endif
 };
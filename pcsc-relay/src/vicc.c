@@ -31,30 +31,41 @@
 unsigned int viccport = VPCDPORT;
 char *vicchostname = NULL;
 char *viccatr = "3B80800101";
-unsigned char atr[256];
-size_t atr_len = 0;
 
+struct vicc_data {
+    struct vicc_ctx *ctx;
+    unsigned char atr[256];
+    size_t atr_len;
+};
 
 
-static int _vicc_connect(driver_data_t **driver_data)
+
+static int _vicc_connect(driver_data_t **driver_data, unsigned int session)
 {
-    struct vicc_ctx *ctx;
+    struct vicc_data *data;
     const long secs = 300;
+    /* session n uses the port viccport+n */
+    unsigned short port = viccport + session;
 
     if (!driver_data)
         return 0;
 
+    data = realloc(*driver_data, sizeof *data);
+    if (!data)
+        return 0;
+    data->ctx = NULL;
+    *driver_data = data;
+
     if (viccatr) {
-        size_t i;
-        unsigned char *hex = viccatr;
-        unsigned char *bin = atr;
-        atr_len = strlen(viccatr);
-        if (atr_len % 2 != 0) {
+        const char *hex = viccatr;
+        unsigned char *bin = data->atr;
+        data->atr_len = strlen(viccatr);
+        if (data->atr_len % 2 != 0) {
             RELAY_ERROR("Length of ATR needs to be even\n");
             return 0;
         }
-        atr_len /= 2;
-        if (atr_len > sizeof atr) {
+        data->atr_len /= 2;
+        if (data->atr_len > sizeof data->atr) {
             RELAY_ERROR("ATR too long\n");
             return 0;
         }
@@ -67,33 +78,74 @@ static int _vicc_connect(driver_data_t **driver_data)
             bin += 1;
         }
     } else {
-        atr_len = 0;
+        data->atr_len = 0;
     }
 
 
-    ctx = vicc_init(vicchostname, viccport);
-    if (!ctx) {
+    data->ctx = vicc_init(vicchostname, port);
+    if (!data->ctx) {
         RELAY_ERROR("Could not initialize connection to VPCD\n");
         return 0;
     }
-    *driver_data = ctx;
 
-    INFO("Waiting for VPCD on port %hu for %ld seconds\n",
-            (unsigned short) viccport, secs);
-    if (vicc_connect(ctx, secs, 0))
+    INFO("Waiting for VPCD on port %hu for %ld seconds\n", port, secs);
+    if (vicc_connect(data->ctx, secs, 0))
         return 1;
 
     return 0;
 }
 
-static int vicc_disconnect(driver_data_t *driver_data)
+static int _vicc_reconnect(driver_data_t *driver_data)
 {
-    struct vicc_ctx *ctx = driver_data;
+    struct vicc_data *data = driver_data;
+    const long secs = 300;
 
-    vicc_eject(ctx);
-    if (vicc_exit(ctx) != 0) {
-        RELAY_ERROR("Could not close connection to virtual ICC\n");
+    if (!data || !data->ctx)
         return 0;
+
+    /* keep listening on the same socket for VPCD to come back */
+    vicc_eject(data->ctx);
+
+    INFO("Waiting for VPCD for %ld seconds\n", secs);
+    return vicc_connect(data->ctx, secs, 0);
+}
+
+static int vicc_disconnect(driver_data_t *driver_data)
+{
+    struct vicc_data *data = driver_data;
+    int r = 1;
+
+    if (data) {
+        if (data->ctx) {
+            vicc_eject(data->ctx);
+            if (vicc_exit(data->ctx) != 0) {
+                RELAY_ERROR("Could not close connection to virtual ICC\n");
+                r = 0;
+            }
+        }
+        free(data);
+    }
+
+    return r;
+}
+
+static int vicc_handle_ctrl(struct vicc_data *data, unsigned char ctrl)
+{
+    switch (ctrl) {
+        case VPCD_CTRL_OFF:
+        case VPCD_CTRL_ON:
+        case VPCD_CTRL_RESET:
+            // ignore reset, power on, power off
+            break;
+        case VPCD_CTRL_ATR:
+            if (vicc_transmit(data->ctx, data->atr_len, data->atr, NULL) < 0) {
+                RELAY_ERROR("could not send ATR\n");
+                return 0;
+            }
+            break;
+        default:
+            RELAY_ERROR("Unknown request: 0x%0X\n", ctrl);
+            return 0;
     }
 
     return 1;
@@ -102,12 +154,13 @@ static int vicc_disconnect(driver_data_t *driver_data)
 static int vicc_receive_capdu(driver_data_t *driver_data,
         unsigned char **capdu, size_t *len)
 {
-    struct vicc_ctx *ctx = driver_data;
+    struct vicc_data *data = driver_data;
+    struct vicc_ctx *ctx = data ? data->ctx : NULL;
 
     int r = 0;
     ssize_t size;
 
-    if (!len)
+    if (!ctx || !len)
         goto err;
 
     do {
@@ -119,22 +172,8 @@ static int vicc_receive_capdu(driver_data_t *driver_data,
         }
 
         if (size == VPCD_CTRL_LEN) {
-            switch (*capdu[0]) {
-                case VPCD_CTRL_OFF:
-                case VPCD_CTRL_ON:
-                case VPCD_CTRL_RESET:
-                    // ignore reset, power on, power off
-                    break;
-                case VPCD_CTRL_ATR:
-                    if (vicc_transmit(ctx, atr_len, atr, NULL) < 0) {
-                        RELAY_ERROR("could not send ATR\n");
-                        goto err;
-                    }
-                    break;
-                default:
-                    RELAY_ERROR("Unknown request: 0x%0X\n", *capdu[0]);
-                    goto err;
-            }
+            if (!vicc_handle_ctrl(data, *capdu[0]))
+                goto err;
         } else {
             // finaly we got the capdu
             *len = size;
@@ -149,7 +188,8 @@ err:
 static int vicc_send_rapdu(driver_data_t *driver_data,
         const unsigned char *rapdu, size_t len)
 {
-    struct vicc_ctx *ctx = driver_data;
+    struct vicc_data *data = driver_data;
+    struct vicc_ctx *ctx = data ? data->ctx : NULL;
 
     if (!ctx || !rapdu)
         return 0;
@@ -163,9 +203,53 @@ static int vicc_send_rapdu(driver_data_t *driver_data,
 }
 
 
+static int vicc_get_fd(driver_data_t *driver_data)
+{
+    struct vicc_data *data = driver_data;
+
+    return data ? vicc_getfd(data->ctx) : -1;
+}
+
+static int vicc_receive_capdu_nb(driver_data_t *driver_data,
+        unsigned char **capdu, size_t *len)
+{
+    struct vicc_data *data = driver_data;
+    struct vicc_ctx *ctx = data ? data->ctx : NULL;
+    ssize_t size;
+
+    if (!ctx || !capdu || !len)
+        return 0;
+
+    *len = 0;
+    while (1) {
+        size = vicc_receive_nb(ctx, capdu);
+
+        if (size < 0) {
+            RELAY_ERROR("could not receive request\n");
+            return 0;
+        }
+
+        if (size == 0)
+            /* wait for more data */
+            return 1;
+
+        if (size == VPCD_CTRL_LEN) {
+            if (!vicc_handle_ctrl(data, *capdu[0]))
+                return 0;
+        } else {
+            *len = size;
+            return 1;
+        }
+    }
+}
+
+
 struct rf_driver driver_vicc = {
     .connect = _vicc_connect,
+    .reconnect = _vicc_reconnect,
     .disconnect = vicc_disconnect,
     .receive_capdu = vicc_receive_capdu,
     .send_rapdu = vicc_send_rapdu,
+    .get_fd = vicc_get_fd,
+    .receive_capdu_nb = vicc_receive_capdu_nb,
 };
@@ -31,10 +31,18 @@
 unsigned int vpcdport = VPCDPORT;
 char *vpcdhostname = NULL;
 
+struct vpcd_data {
+    struct vicc_ctx *ctx;
+    /* R-APDU received by vpcd_receive_rapdu_nb */
+    unsigned char *rapdu;
+};
+
 
-static int vpcd_connect(driver_data_t **driver_data)
+static int vpcd_connect(driver_data_t **driver_data, unsigned int session)
 {
-    struct vicc_ctx *ctx;
+    struct vpcd_data *data;
+    /* session n uses the port vpcdport+n */
+    unsigned short port = vpcdport + session;
 
     int vicc_found = 0;
 
@@ -42,18 +50,23 @@ static int vpcd_connect(driver_data_t **driver_data)
         return 0;
 
 
-    ctx = vicc_init(vpcdhostname, vpcdport);
-    if (!ctx) {
+    data = realloc(*driver_data, sizeof *data);
+    if (!data)
+        return 0;
+    data->ctx = NULL;
+    data->rapdu = NULL;
+    *driver_data = data;
+
+    data->ctx = vicc_init(vpcdhostname, port);
+    if (!data->ctx) {
         RELAY_ERROR("Could not initialize connection to virtual ICC\n");
         return 0;
     }
-    *driver_data = ctx;
 
 
-    INFO("Waiting for virtual ICC on port %hu\n",
-            (unsigned short) vpcdport);
+    INFO("Waiting for virtual ICC on port %hu\n", port);
     do {
-        switch (vicc_present(ctx)) {
+        switch (vicc_present(data->ctx)) {
             case 0:
                 /* not present */
                 sleep(1);
@@ -68,7 +81,7 @@ static int vpcd_connect(driver_data_t **driver_data)
     } while (!vicc_found);
 
 
-    if (vicc_poweron(ctx) < 0) {
+    if (vicc_poweron(data->ctx) < 0) {
         RELAY_ERROR("could not powerup\n");
         return 0;
     }
@@ -81,40 +94,50 @@ static int vpcd_connect(driver_data_t **driver_data)
 
 static int vpcd_disconnect(driver_data_t *driver_data)
 {
-    struct vicc_ctx *ctx = driver_data;
+    struct vpcd_data *data = driver_data;
+    int r = 1;
 
-    if (vicc_eject(ctx) != 0)
-        DEBUG("Could not eject virtual ICC\n");
+    if (data) {
+        if (vicc_eject(data->ctx) != 0)
+            DEBUG("Could not eject virtual ICC\n");
 
-    if (vicc_exit(ctx) != 0) {
-        RELAY_ERROR("Could not close connection to virtual ICC\n");
-        return 0;
+        if (vicc_exit(data->ctx) != 0) {
+            RELAY_ERROR("Could not close connection to virtual ICC\n");
+            r = 0;
+        }
+
+        free(data->rapdu);
+        free(data);
     }
 
-    return 1;
+    return r;
 }
 
 static int vpcd_transmit(driver_data_t *driver_data,
         const unsigned char *send, size_t send_len,
         unsigned char *recv, size_t *recv_len)
 {
-    struct vicc_ctx *ctx = driver_data;
+    struct vpcd_data *data = driver_data;
 
-    unsigned char *rapdu = NULL;
     int r = 0;
-    ssize_t size = vicc_transmit(ctx, send_len, send, &rapdu);
+    ssize_t size;
+
+    if (!data)
+        goto err;
+
+    size = vicc_transmit(data->ctx, send_len, send, &data->rapdu);
 
     if (size < 0) {
         RELAY_ERROR("could not send apdu or receive rapdu\n");
         goto err;
     }
 
-    if (*recv_len < size) {
+    if (*recv_len < (size_t) size) {
         RELAY_ERROR("Not enough memory for rapdu\n");
         goto err;
     }
 
-    memcpy(recv, rapdu, size);
+    memcpy(recv, data->rapdu, size);
     *recv_len = size;
 
     r = 1;
@@ -123,14 +146,64 @@ err:
     if (!r)
         *recv_len = 0;
 
-    free(rapdu);
-
     return r;
 }
 
+static int vpcd_get_fd(driver_data_t *driver_data)
+{
+    struct vpcd_data *data = driver_data;
+
+    return data ? vicc_getfd(data->ctx) : -1;
+}
+
+static int vpcd_send_capdu(driver_data_t *driver_data,
+        const unsigned char *send, size_t send_len)
+{
+    struct vpcd_data *data = driver_data;
+
+    if (!data || vicc_transmit(data->ctx, send_len, send, NULL) < 0) {
+        RELAY_ERROR("could not send apdu\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+static int vpcd_receive_rapdu_nb(driver_data_t *driver_data,
+        unsigned char *recv, size_t *recv_len)
+{
+    struct vpcd_data *data = driver_data;
+    ssize_t size;
+
+    if (!data)
+        return 0;
+
+    size = vicc_receive_nb(data->ctx, &data->rapdu);
+    if (size < 0) {
+        RELAY_ERROR("could not receive rapdu\n");
+        *recv_len = 0;
+        return 0;
+    }
+
+    if (*recv_len < (size_t) size) {
+        RELAY_ERROR("Not enough memory for rapdu\n");
+        *recv_len = 0;
+        return 0;
+    }
+
+    if (size)
+        memcpy(recv, data->rapdu, size);
+    *recv_len = size;
+
+    return 1;
+}
+
 
 struct sc_driver driver_vpcd = {
     .connect = vpcd_connect,
     .disconnect = vpcd_disconnect,
     .transmit = vpcd_transmit,
+    .get_fd = vpcd_get_fd,
+    .send_capdu = vpcd_send_capdu,
+    .receive_rapdu_nb = vpcd_receive_rapdu_nb,
 };
@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "control.h"
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_SYS_UN_H) && defined(HAVE_POLL_H)
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if (!defined HAVE_DECL_MSG_NOSIGNAL) || !HAVE_DECL_MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* same as MONITOR_MAX_SLOTS in monitor.c */
+#define CONTROL_MAX_SLOTS 16
+/* maximum length of a command including the newline */
+#define CONTROL_LINE_MAX 256
+/* clients are served one after the other, so an idle client is dropped to
+ * let the others in */
+#define CONTROL_IDLE_MS 5000
+
+static vicc_control_handler handlers[CONTROL_MAX_SLOTS];
+static size_t slot_count = 0;
+static int running = 0;
+static int listen_fd = -1;
+static int wakeup[2] = {-1, -1};
+static char *socket_path = NULL;
+static pthread_t thread;
+/* protects handlers and running, held while a handler is called */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+/* serializes starting and stopping the control thread */
+static pthread_mutex_t start_stop = PTHREAD_MUTEX_INITIALIZER;
+
+static int handle_line(char *line)
+{
+    char *end;
+    size_t len;
+    unsigned long slot;
+    int r = -1;
+
+    /* strip trailing white space including '\r' */
+    len = strlen(line);
+    while (len && isspace((unsigned char) line[len-1]))
+        line[--len] = '\0';
+
+    errno = 0;
+    slot = strtoul(line, &end, 10);
+    if (errno || end == line || !isspace((unsigned char) *end))
+        return -1;
+    while (isspace((unsigned char) *end))
+        end++;
+    if (!*end)
+        return -1;
+
+    pthread_mutex_lock(&mutex);
+    if (slot < CONTROL_MAX_SLOTS && handlers[slot])
+        r = handlers[slot]((size_t) slot, end);
+    pthread_mutex_unlock(&mutex);
+
+    return r;
+}
+
+static void reply(int fd, int r)
+{
+    const char *msg = r == 0 ? "OK\n" : "ERROR\n";
+    if (send(fd, msg, strlen(msg), MSG_NOSIGNAL) < 0) {
+        /* the client will notice */
+    }
+}
+
+static void serve_client(int fd)
+{
+    struct pollfd fds[2];
+    char buf[CONTROL_LINE_MAX+1], *nl;
+    size_t len = 0;
+    ssize_t n;
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeup[0];
+    fds[1].events = POLLIN;
+
+    while (1) {
+        n = poll(fds, 2, CONTROL_IDLE_MS);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (n == 0 || fds[1].revents)
+            /* idle for too long or let the main loop check whether we're
+             * stopping */
+            break;
+
+        n = read(fd, buf + len, CONTROL_LINE_MAX - len);
+        if (n <= 0)
+            break;
+        len += n;
+        buf[len] = '\0';
+
+        while ((nl = memchr(buf, '\n', len)) != NULL) {
+            *nl = '\0';
+            reply(fd, handle_line(buf));
+            len -= nl + 1 - buf;
+            memmove(buf, nl + 1, len);
+            buf[len] = '\0';
+        }
+
+        if (len == CONTROL_LINE_MAX) {
+            reply(fd, -1);
+            break;
+        }
+    }
+}
+
+static void *control_thread(void *arg)
+{
+    struct pollfd fds[2];
+    char c;
+    int fd;
+
+    (void) arg;
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeup[0];
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents) {
+            while (read(wakeup[0], &c, sizeof c) > 0)
+                ;
+            pthread_mutex_lock(&mutex);
+            if (!running) {
+                pthread_mutex_unlock(&mutex);
+                break;
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+
+        if (fds[0].revents) {
+            fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                serve_client(fd);
+                close(fd);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int opensock(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = -1, probe = -1;
+
+    if (strlen(path) >= sizeof addr.sun_path)
+        goto err;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        goto err;
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof addr) != 0) {
+        if (errno != EADDRINUSE)
+            goto err;
+
+        /* only replace the socket if nobody is listening on it anymore */
+        probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe < 0
+                || connect(probe, (struct sockaddr *) &addr, sizeof addr) == 0)
+            goto err;
+        if (unlink(path) != 0
+                || bind(fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+            goto err;
+    }
+
+    if (chmod(path, S_IRUSR|S_IWUSR) != 0 || listen(fd, 1) != 0) {
+        unlink(path);
+        goto err;
+    }
+
+    if (probe >= 0)
+        close(probe);
+
+    return fd;
+
+err:
+    if (probe >= 0)
+        close(probe);
+    if (fd >= 0)
+        close(fd);
+
+    return -1;
+}
+
+/* must be called with start_stop held */
+static int control_start(void)
+{
+    const char *path = getenv("VPCD_CONTROL");
+
+    if (!path || !*path)
+        goto err;
+
+    socket_path = strdup(path);
+    if (!socket_path)
+        goto err;
+
+    listen_fd = opensock(socket_path);
+    if (listen_fd < 0) {
+        free(socket_path);
+        socket_path = NULL;
+        goto err;
+    }
+
+    if (pipe(wakeup) != 0
+            || fcntl(wakeup[0], F_SETFL, O_NONBLOCK) != 0
+            || fcntl(wakeup[1], F_SETFL, O_NONBLOCK) != 0)
+        goto err;
+
+    running = 1;
+    if (pthread_create(&thread, NULL, control_thread, NULL) != 0) {
+        running = 0;
+        goto err;
+    }
+
+    return 1;
+
+err:
+    if (socket_path) {
+        unlink(socket_path);
+        free(socket_path);
+    }
+    if (listen_fd >= 0)
+        close(listen_fd);
+    if (wakeup[0] >= 0)
+        close(wakeup[0]);
+    if (wakeup[1] >= 0)
+        close(wakeup[1]);
+    socket_path = NULL;
+    listen_fd = wakeup[0] = wakeup[1] = -1;
+
+    return 0;
+}
+
+/* must be called with start_stop held */
+static void control_stop(void)
+{
+    char c = 0;
+
+    pthread_mutex_lock(&mutex);
+    running = 0;
+    pthread_mutex_unlock(&mutex);
+
+    if (write(wakeup[1], &c, sizeof c) < 0) {
+        /* see monitor_notify() in monitor.c */
+    }
+    pthread_join(thread, NULL);
+
+    unlink(socket_path);
+    free(socket_path);
+    close(listen_fd);
+    close(wakeup[0]);
+    close(wakeup[1]);
+    socket_path = NULL;
+    listen_fd = wakeup[0] = wakeup[1] = -1;
+}
+
+int vicc_control_add(size_t slot, vicc_control_handler handler)
+{
+    int r = 0;
+
+    if (slot >= CONTROL_MAX_SLOTS || !handler)
+        return 0;
+
+    pthread_mutex_lock(&start_stop);
+
+    if (handlers[slot])
+        goto err;
+
+    if (!slot_count && !control_start())
+        goto err;
+
+    pthread_mutex_lock(&mutex);
+    handlers[slot] = handler;
+    slot_count++;
+    pthread_mutex_unlock(&mutex);
+
+    r = 1;
+
+err:
+    pthread_mutex_unlock(&start_stop);
+
+    return r;
+}
+
+void vicc_control_remove(size_t slot)
+{
+    int stop = 0;
+
+    if (slot >= CONTROL_MAX_SLOTS)
+        return;
+
+    pthread_mutex_lock(&start_stop);
+
+    /* waits for a running handler */
+    pthread_mutex_lock(&mutex);
+    if (handlers[slot]) {
+        handlers[slot] = NULL;
+        slot_count--;
+        if (!slot_count)
+            stop = 1;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (stop)
+        control_stop();
+
+    pthread_mutex_unlock(&start_stop);
+}
+
+#else
+
+int vicc_control_add(size_t slot, vicc_control_handler handler)
+{
+    return 0;
+}
+
+void vicc_control_remove(size_t slot)
+{
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Handler for re-pointing a slot at a different virtual ICC
+ *
+ * @param[in] slot        Index of the slot
+ * @param[in] device_name New endpoint in the same format as \c DEVICENAME in
+ *                        reader.conf, i.e. \c /dev/null:port or \c host:port
+ *
+ * @return 0 on success, -1 if the slot still uses the old endpoint
+ */
+typedef int (*vicc_control_handler)(size_t slot, const char *device_name);
+
+/**
+ * @brief Accept commands for a slot on the control socket
+ *
+ * The first call opens the Unix domain socket given in the environment
+ * variable \c VPCD_CONTROL and starts a background thread serving it. The
+ * thread is stopped when the last slot is removed.
+ *
+ * Each line received on the socket has the format <tt>slot device_name</tt>
+ * and is answered with \c OK or \c ERROR.
+ *
+ * @return 1 if the control socket is available, 0 otherwise.
+ */
+int vicc_control_add(size_t slot, vicc_control_handler handler);
+
+/**
+ * @brief Stop accepting commands for a slot
+ *
+ * Waits for a running handler of the slot to finish.
+ */
+void vicc_control_remove(size_t slot);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,498 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of ifd-vpcd without pcscd: The driver is loaded with dlopen and
+ * driven by multiple threads. Each slot is served by an embedded virtual ICC,
+ * which answers every command APDU with a fixed response.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "vpcd.h"
+
+#include <wintypes.h>
+
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <ifdhandler.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#if (!defined HAVE_DECL_MSG_NOSIGNAL) || !HAVE_DECL_MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef IFDVPCD_LIB
+#define IFDVPCD_LIB "libifdvpcd.so"
+#endif
+
+#define BENCH_PORT 35990
+#define BENCH_MAX_SLOTS 16
+
+static RESPONSECODE (*IFDHCreateChannel_p)(DWORD, DWORD);
+static RESPONSECODE (*IFDHCloseChannel_p)(DWORD);
+static RESPONSECODE (*IFDHGetCapabilities_p)(DWORD, DWORD, PDWORD, PUCHAR);
+static RESPONSECODE (*IFDHPowerICC_p)(DWORD, DWORD, PUCHAR, PDWORD);
+static RESPONSECODE (*IFDHTransmitToICC_p)(DWORD, SCARD_IO_HEADER, PUCHAR,
+        DWORD, PUCHAR, PDWORD, PSCARD_IO_HEADER);
+static RESPONSECODE (*IFDHICCPresence_p)(DWORD);
+
+static unsigned short port = BENCH_PORT;
+static size_t slots = 0;
+static size_t threads = 4;
+static unsigned long apdus = 1000;
+static unsigned long polls = 10000;
+static size_t response_size = 0;
+
+static const unsigned char atr[] = {0x3B, 0x80, 0x80, 0x01, 0x01};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__linux__) && defined(RTLD_NEXT)
+/* Count the driver's mutex operations by interposing pthread_mutex_lock. The
+ * driver is linked against our exported symbol because the benchmark is built
+ * with -export-dynamic. */
+#define BENCH_LOCK_STATS 1
+
+static struct {
+    unsigned long locks;
+    unsigned long contended;
+    unsigned long long wait_ns;
+} lock_stats;
+
+static int (*real_mutex_lock)(pthread_mutex_t *);
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    unsigned long long start;
+    int r;
+
+    __sync_fetch_and_add(&lock_stats.locks, 1);
+    if (pthread_mutex_trylock(mutex) == 0)
+        return 0;
+
+    __sync_fetch_and_add(&lock_stats.contended, 1);
+    start = now_ns();
+    r = real_mutex_lock(mutex);
+    __sync_fetch_and_add(&lock_stats.wait_ns, now_ns() - start);
+
+    return r;
+}
+
+static void lock_stats_reset(void)
+{
+    __sync_lock_test_and_set(&lock_stats.locks, 0);
+    __sync_lock_test_and_set(&lock_stats.contended, 0);
+    __sync_lock_test_and_set(&lock_stats.wait_ns, 0);
+}
+
+static void lock_stats_print(void)
+{
+    printf("  mutex:    %lu locks, %lu contended (%.2f%%), %.3f ms waited\n",
+            lock_stats.locks, lock_stats.contended,
+            lock_stats.locks ?
+            100.*lock_stats.contended/lock_stats.locks : 0.,
+            lock_stats.wait_ns/1e6);
+}
+#else
+static void lock_stats_reset(void)
+{
+}
+
+static void lock_stats_print(void)
+{
+    printf("  mutex:    not available on this platform\n");
+}
+#endif
+
+/* embedded virtual ICC */
+
+static ssize_t recv_all(int sock, unsigned char *buf, size_t len)
+{
+    size_t received;
+    ssize_t r;
+
+    for (received = 0; received < len; received += r) {
+        r = recv(sock, buf + received, len - received, 0);
+        if (r <= 0)
+            return -1;
+    }
+
+    return received;
+}
+
+static int send_msg(int sock, unsigned char *buf, size_t len)
+{
+    /* length and data are sent in one go */
+    buf[0] = (len >> 8) & 0xff;
+    buf[1] = len & 0xff;
+    return send(sock, buf, len + 2, MSG_NOSIGNAL) == (ssize_t) (len + 2) ?
+        0 : -1;
+}
+
+static void *vicc_thread(void *arg)
+{
+    size_t slot = (size_t) arg;
+    struct sockaddr_in addr;
+    unsigned char *buf;
+    size_t len;
+    int sock = -1, yes = 1, i;
+
+    buf = malloc(2 + 0xffff + 2);
+    if (!buf)
+        goto err;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port + slot);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (i = 0; i < 100; i++) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0)
+            goto err;
+        if (connect(sock, (struct sockaddr *) &addr, sizeof addr) == 0)
+            break;
+        close(sock);
+        sock = -1;
+        usleep(10000);
+    }
+    if (sock < 0)
+        goto err;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+
+    while (recv_all(sock, buf, 2) == 2) {
+        len = (buf[0] << 8) | buf[1];
+        if (recv_all(sock, buf + 2, len) != (ssize_t) len)
+            break;
+
+        if (len == VPCD_CTRL_LEN) {
+            if (buf[2] == VPCD_CTRL_ATR) {
+                memcpy(buf + 2, atr, sizeof atr);
+                if (send_msg(sock, buf, sizeof atr) != 0)
+                    break;
+            }
+            continue;
+        }
+
+        /* response data followed by 90 00 */
+        memset(buf + 2, 0xAB, response_size);
+        buf[2 + response_size] = 0x90;
+        buf[2 + response_size + 1] = 0x00;
+        if (send_msg(sock, buf, response_size + 2) != 0)
+            break;
+    }
+
+err:
+    if (sock >= 0)
+        close(sock);
+    free(buf);
+
+    return NULL;
+}
+
+/* benchmark threads */
+
+struct worker {
+    pthread_t thread;
+    size_t slot;
+    unsigned long done;
+    unsigned long failed;
+    unsigned long long min_ns;
+    unsigned long long max_ns;
+    unsigned long long sum_ns;
+};
+
+static void worker_reset(struct worker *w, size_t i)
+{
+    w->slot = i % slots;
+    w->done = 0;
+    w->failed = 0;
+    w->min_ns = (unsigned long long) -1;
+    w->max_ns = 0;
+    w->sum_ns = 0;
+}
+
+static void worker_time(struct worker *w, unsigned long long start, int ok)
+{
+    unsigned long long t = now_ns() - start;
+
+    if (!ok)
+        w->failed++;
+    w->done++;
+    w->sum_ns += t;
+    if (t < w->min_ns)
+        w->min_ns = t;
+    if (t > w->max_ns)
+        w->max_ns = t;
+}
+
+static void *presence_thread(void *arg)
+{
+    struct worker *w = arg;
+    unsigned long i;
+    unsigned long long start;
+
+    for (i = 0; i < polls; i++) {
+        start = now_ns();
+        worker_time(w, start,
+                IFDHICCPresence_p(w->slot) == IFD_ICC_PRESENT);
+    }
+
+    return NULL;
+}
+
+static void *transmit_thread(void *arg)
+{
+    struct worker *w = arg;
+    SCARD_IO_HEADER send_pci = {1, 0}, recv_pci;
+    unsigned char capdu[] = {0x00, 0xB0, 0x00, 0x00, 0x00};
+    unsigned char *rapdu;
+    DWORD rapdu_len;
+    unsigned long i;
+    unsigned long long start;
+
+    capdu[4] = response_size & 0xff;
+    rapdu = malloc(0xffff + 2);
+    if (!rapdu)
+        return NULL;
+
+    for (i = 0; i < apdus; i++) {
+        rapdu_len = 0xffff + 2;
+        start = now_ns();
+        worker_time(w, start,
+                IFDHTransmitToICC_p(w->slot, send_pci, capdu, sizeof capdu,
+                    rapdu, &rapdu_len, &recv_pci) == IFD_SUCCESS
+                && rapdu_len == response_size + 2);
+    }
+
+    free(rapdu);
+
+    return NULL;
+}
+
+static int run(const char *name, void *(*main)(void *), struct worker *workers)
+{
+    unsigned long long start, elapsed, sum = 0, min = (unsigned long long) -1,
+                       max = 0;
+    unsigned long done = 0, failed = 0;
+    size_t i;
+
+    for (i = 0; i < threads; i++)
+        worker_reset(&workers[i], i);
+    lock_stats_reset();
+
+    start = now_ns();
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, main, &workers[i]) != 0) {
+            fprintf(stderr, "Could not create thread\n");
+            return -1;
+        }
+    }
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    elapsed = now_ns() - start;
+
+    for (i = 0; i < threads; i++) {
+        done += workers[i].done;
+        failed += workers[i].failed;
+        sum += workers[i].sum_ns;
+        if (workers[i].min_ns < min)
+            min = workers[i].min_ns;
+        if (workers[i].max_ns > max)
+            max = workers[i].max_ns;
+    }
+
+    printf("%s:\n", name);
+    printf("  calls:    %lu in %.3f s (%.0f/s), %lu failed\n",
+            done, elapsed/1e9, done ? done/(elapsed/1e9) : 0., failed);
+    printf("  latency:  min %.1f us, avg %.1f us, max %.1f us\n",
+            done ? min/1e3 : 0., done ? sum/1e3/done : 0.,
+            max/1e3);
+    lock_stats_print();
+
+    return failed ? -1 : 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-l driver] [-p port] [-s slots] [-t threads] [-n apdus] [-P polls] [-z size]\n"
+            "  -l driver   ifd-vpcd library to load (default %s)\n"
+            "  -p port     first port to use (default %d)\n"
+            "  -s slots    number of slots to use (default all)\n"
+            "  -t threads  number of threads, distributed over the slots (default 4)\n"
+            "  -n apdus    APDUs to transmit per thread (default 1000)\n"
+            "  -P polls    presence checks per thread (default 10000)\n"
+            "  -z size     size of the response data (default 0)\n",
+            argv0, IFDVPCD_LIB, BENCH_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *driver = IFDVPCD_LIB;
+    void *handle = NULL;
+    struct worker *workers = NULL;
+    pthread_t vicc[BENCH_MAX_SLOTS];
+    size_t created = 0, started = 0, i;
+    UCHAR value[MAX_ATR_SIZE];
+    DWORD len;
+    unsigned long long start;
+    int opt, r = EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "l:p:s:t:n:P:z:h")) != -1) {
+        switch (opt) {
+            case 'l':
+                driver = optarg;
+                break;
+            case 'p':
+                port = (unsigned short) strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                slots = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                apdus = strtoul(optarg, NULL, 0);
+                break;
+            case 'P':
+                polls = strtoul(optarg, NULL, 0);
+                break;
+            case 'z':
+                response_size = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (!threads || response_size > 0xffff - 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+#ifdef BENCH_LOCK_STATS
+    real_mutex_lock = dlsym(RTLD_NEXT, "pthread_mutex_lock");
+#endif
+
+    handle = dlopen(driver, RTLD_NOW|RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        goto err;
+    }
+    if (!(IFDHCreateChannel_p = dlsym(handle, "IFDHCreateChannel"))
+            || !(IFDHCloseChannel_p = dlsym(handle, "IFDHCloseChannel"))
+            || !(IFDHGetCapabilities_p = dlsym(handle, "IFDHGetCapabilities"))
+            || !(IFDHPowerICC_p = dlsym(handle, "IFDHPowerICC"))
+            || !(IFDHTransmitToICC_p = dlsym(handle, "IFDHTransmitToICC"))
+            || !(IFDHICCPresence_p = dlsym(handle, "IFDHICCPresence"))) {
+        fprintf(stderr, "%s\n", dlerror());
+        goto err;
+    }
+
+    len = sizeof value;
+    if (IFDHGetCapabilities_p(0, TAG_IFD_SLOTS_NUMBER, &len, value)
+            != IFD_SUCCESS || len != 1) {
+        fprintf(stderr, "Could not get number of slots\n");
+        goto err;
+    }
+    if (!slots || slots > value[0])
+        slots = value[0];
+    if (slots > BENCH_MAX_SLOTS)
+        slots = BENCH_MAX_SLOTS;
+
+    workers = calloc(threads, sizeof *workers);
+    if (!workers)
+        goto err;
+
+    printf("%s: %zu slot(s), %zu thread(s), %zu byte(s) response data\n",
+            driver, slots, threads, response_size);
+
+    start = now_ns();
+    for (created = 0; created < slots; created++) {
+        if (IFDHCreateChannel_p(created, port) != IFD_SUCCESS) {
+            fprintf(stderr, "Could not create channel for slot %zu\n",
+                    created);
+            goto err;
+        }
+    }
+    for (started = 0; started < slots; started++) {
+        if (pthread_create(&vicc[started], NULL, vicc_thread,
+                    (void *) started) != 0) {
+            fprintf(stderr, "Could not start virtual ICC\n");
+            goto err;
+        }
+    }
+    for (i = 0; i < slots; i++) {
+        while (IFDHICCPresence_p(i) != IFD_ICC_PRESENT) {
+            if (now_ns() - start > 5000000000ULL) {
+                fprintf(stderr, "Virtual ICC did not connect to slot %zu\n", i);
+                goto err;
+            }
+            usleep(1000);
+        }
+        len = sizeof value;
+        if (IFDHPowerICC_p(i, IFD_POWER_UP, value, &len) != IFD_SUCCESS) {
+            fprintf(stderr, "Could not power up slot %zu\n", i);
+            goto err;
+        }
+    }
+    printf("setup:      %.3f ms\n", (now_ns() - start)/1e6);
+
+    if (run("presence", presence_thread, workers) != 0
+            || run("transmit", transmit_thread, workers) != 0)
+        goto err;
+
+    r = EXIT_SUCCESS;
+
+err:
+    for (i = 0; i < created; i++) {
+        len = sizeof value;
+        IFDHPowerICC_p(i, IFD_POWER_DOWN, value, &len);
+        /* closing the channel disconnects the virtual ICC */
+        IFDHCloseChannel_p(i);
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(vicc[i], NULL);
+    free(workers);
+    if (handle)
+        dlclose(handle);
+
+    return r;
+}
@@ -20,17 +20,47 @@
 #include "config.h"
 #endif
 
+#include "control.h"
 #include "ifd-vpcd.h"
+#include "lock.h"
+#include "monitor.h"
+#include "trace.h"
 #include "vpcd.h"
 
 #include <wintypes.h>
 
 #include <errno.h>
 #include <ifdhandler.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_READER_H
+#include <reader.h>
+#endif
+#ifndef SCARD_ATTR_MAXINPUT
+#define SCARD_ATTR_MAXINPUT 0x0007A007
+#endif
+#ifndef SCARD_CTL_CODE
+#define SCARD_CTL_CODE(code) (0x42000000 + (code))
+#endif
+#ifndef CM_IOCTL_GET_FEATURE_REQUEST
+#define CM_IOCTL_GET_FEATURE_REQUEST SCARD_CTL_CODE(3400)
+#endif
+#ifndef FEATURE_GET_TLV_PROPERTIES
+#define FEATURE_GET_TLV_PROPERTIES 0x12
+#endif
+#ifndef PCSCv2_PART10_PROPERTY_dwMaxAPDUDataSize
+#define PCSCv2_PART10_PROPERTY_dwMaxAPDUDataSize 10
+#endif
+/* same ioctl as used by the CCID driver */
+#define IOCTL_FEATURE_GET_TLV_PROPERTIES SCARD_CTL_CODE(FEATURE_GET_TLV_PROPERTIES + 0x330000)
+
+/* maximum size of a command APDU with short and extended length */
+#define VICC_MAX_SHORT_APDU     (4+1+0xff+1)
+#define VICC_MAX_EXTENDED_APDU  (4+3+0xffff+2)
+
 /* pcscd allows at most 16 readers. Apple's SmartCardServices on OS X 10.10
  * freaks out if more than 8 slots are registered. We want only two slots... */
 #define VICC_MAX_SLOTS (VPCDSLOTS <= PCSCLITE_MAX_READERS_CONTEXTS ? VPCDSLOTS : PCSCLITE_MAX_READERS_CONTEXTS)
@@ -74,6 +104,10 @@ void log_msg(const int priority, const char *fmt, ...)
 			syslog_level = LOG_DEBUG;
 	}
 
+	/* don't format anything if syslog discards the message anyway */
+	if (!(setlogmask(0) & LOG_MASK(syslog_level)))
+		return;
+
 	va_start(argptr, fmt);
 	(void)vsnprintf(debug_buffer, sizeof debug_buffer, fmt, argptr);
 	va_end(argptr);
@@ -102,39 +136,140 @@ void log_msg(const int priority, const char *fmt, ...)
 #endif
 
 static struct vicc_ctx *ctx[VICC_MAX_SLOTS];
+/* protects ctx against being replaced via the control socket */
+static void *slot_lock[VICC_MAX_SLOTS];
+/* maximum APDU size advertised by the vicc in its ATR, 0 if unknown */
+static uint32_t maxinput[VICC_MAX_SLOTS];
 const char *hostname = NULL;
 static const char openport[] = "/dev/null";
+static const char unixprefix[] = VPCD_UNIX_PREFIX;
 
-RESPONSECODE
-IFDHCreateChannel (DWORD Lun, DWORD Channel)
+static void trace_sink(const char *line)
 {
-    size_t slot = Lun & 0xffff;
-    if (slot >= vicc_max_slots) {
-        return IFD_COMMUNICATION_ERROR;
+    Log2(PCSC_LOG_INFO, "%s", line);
+}
+
+/* Checks the card capabilities in the ATR's historical bytes for support of
+ * extended length APDUs (ISO 7816-4 8.1.1.2.7, third software function
+ * table). This is how vicc advertises its buffer size. */
+static int atr_extended_length(const unsigned char *atr, size_t atr_len)
+{
+    const unsigned char *hb;
+    size_t i, k, hb_len, len;
+    unsigned char y;
+
+    if (!atr || atr_len < 2)
+        return 0;
+
+    /* T0 */
+    hb_len = atr[1] & 0x0f;
+    y = atr[1] >> 4;
+    i = 2;
+
+    /* skip the interface characters TAi, TBi, TCi, TDi */
+    while (y) {
+        i += (y & 1) + ((y >> 1) & 1) + ((y >> 2) & 1);
+        if (!(y & 8))
+            break;
+        if (i >= atr_len)
+            return 0;
+        y = atr[i] >> 4;
+        i++;
     }
-    if (!hostname)
-        Log2(PCSC_LOG_INFO, "Waiting for virtual ICC on port %hu",
-                (unsigned short) (Channel+slot));
-    ctx[slot] = vicc_init(hostname, Channel+slot);
-    if (!ctx[slot]) {
-        Log1(PCSC_LOG_ERROR, "Could not initialize connection to virtual ICC");
+
+    if (hb_len < 1 || i + hb_len > atr_len)
+        return 0;
+    hb = atr + i;
+
+    /* only the category indicators for COMPACT-TLV are supported */
+    switch (hb[0]) {
+        case 0x80:
+            break;
+        case 0x00:
+            /* status indicator in the last three bytes */
+            if (hb_len < 4)
+                return 0;
+            hb_len -= 3;
+            break;
+        default:
+            return 0;
+    }
+
+    for (k = 1; k < hb_len; k += 1 + len) {
+        len = hb[k] & 0x0f;
+        if (k + 1 + len > hb_len)
+            break;
+        if ((hb[k] & 0xf0) == 0x70 && len >= 3)
+            /* card capabilities */
+            return (hb[k+3] & 0x40) ? 1 : 0;
+    }
+
+    return 0;
+}
+
+static uint32_t get_maxinput(DWORD Lun)
+{
+    size_t slot = Lun & 0xffff;
+    UCHAR atr[MAX_ATR_SIZE];
+    DWORD atr_len = sizeof atr;
+
+    if (!maxinput[slot])
+        /* fetching the ATR initializes maxinput */
+        IFDHGetCapabilities (Lun, TAG_IFD_ATR, &atr_len, atr);
+
+    return maxinput[slot] ? maxinput[slot] : VICC_MAX_SHORT_APDU;
+}
+
+#if defined(ENABLE_PRESENCE_MONITOR) && defined(TAG_IFD_POLLING_THREAD_WITH_TIMEOUT)
+/* pcscd's event handler calls this instead of polling IFDHICCPresence */
+static RESPONSECODE
+IFDHPolling (DWORD Lun, int timeout)
+{
+    size_t slot = Lun & 0xffff;
+    if (vicc_monitor_wait(slot, timeout) < 0) {
         return IFD_COMMUNICATION_ERROR;
     }
-    if (hostname)
-        Log3(PCSC_LOG_INFO, "Connected to virtual ICC on %s port %hu",
-                hostname, (unsigned short) (Channel+slot));
+    return IFD_SUCCESS;
+}
 
+static RESPONSECODE
+IFDHStopPolling (DWORD Lun)
+{
+    vicc_monitor_cancel(Lun & 0xffff);
     return IFD_SUCCESS;
 }
+#endif
 
-RESPONSECODE
-IFDHCreateChannelByName (DWORD Lun, LPSTR DeviceName)
+static int slot_acquire(size_t slot)
 {
-    RESPONSECODE r = IFD_NOT_SUPPORTED;
-    char *dots;
-    char _hostname[MAX_READERNAME];
+    return slot_lock[slot] && lock(slot_lock[slot]);
+}
+
+static void slot_release(size_t slot)
+{
+    unlock(slot_lock[slot]);
+}
+
+/* Parses a device name in the format of reader.conf's DEVICENAME. If a
+ * hostname other than /dev/null is specified, it is copied to _hostname and
+ * *host is pointed to it. *port is left untouched if no port is given. */
+static int parse_device_name(const char *DeviceName, char *_hostname,
+        size_t _hostname_len, const char **host, unsigned long int *port)
+{
+    const char *dots;
     size_t hostname_len;
-    unsigned long int port = VPCDPORT;
+
+    if (strncmp(DeviceName, unixprefix, strlen(unixprefix)) == 0) {
+        /* libvpcd connects to the Unix domain socket, there is no port */
+        hostname_len = strlen(DeviceName);
+        if (hostname_len >= _hostname_len) {
+            Log3(PCSC_LOG_ERROR, "Not enough memory to hold hostname (have %zu, need %zu)", _hostname_len, hostname_len);
+            return -1;
+        }
+        memcpy(_hostname, DeviceName, hostname_len + 1);
+        *host = _hostname;
+        return 0;
+    }
 
     dots = strchr(DeviceName, ':');
     if (dots) {
@@ -145,32 +280,161 @@ IFDHCreateChannelByName (DWORD Lun, LPSTR DeviceName)
                 || strncmp(DeviceName, openport, hostname_len) != 0) {
             /* a hostname other than /dev/null has been specified,
              * so we connect initialize hostname to connect to vicc */
-            if (hostname_len < sizeof _hostname)
+            if (hostname_len < _hostname_len)
                 memcpy(_hostname, DeviceName, hostname_len);
             else {
-                Log3(PCSC_LOG_ERROR, "Not enough memory to hold hostname (have %zu, need %zu)", sizeof _hostname, hostname_len);
-                goto err;
+                Log3(PCSC_LOG_ERROR, "Not enough memory to hold hostname (have %zu, need %zu)", _hostname_len, hostname_len);
+                return -1;
             }
             _hostname[hostname_len] = '\0';
-            hostname = _hostname;
+            *host = _hostname;
         }
 
         /* skip the ':' */
         dots++;
 
         errno = 0;
-        port = strtoul(dots, NULL, 0);
+        *port = strtoul(dots, NULL, 0);
         if (errno) {
             Log2(PCSC_LOG_ERROR, "Could not parse port: %s", dots);
-            goto err;
+            return -1;
         }
     } else {
         Log1(PCSC_LOG_INFO, "Using default port.");
     }
 
-    r = IFDHCreateChannel (Lun, port);
+    return 0;
+}
+
+/* Called from the control thread. The new endpoint is opened before the old
+ * one is closed, so that the slot stays usable if the new one fails. An
+ * unchanged listening port is kept as is, because it can't be opened twice. */
+static int
+slot_repoint (size_t slot, const char *device_name)
+{
+    char _hostname[MAX_READERNAME];
+    const char *host = NULL;
+    unsigned long int port = VPCDPORT;
+    struct vicc_ctx *new_ctx, *old_ctx;
+    int unchanged;
+
+    if (parse_device_name(device_name, _hostname, sizeof _hostname,
+                &host, &port) != 0)
+        return -1;
+    if (port > 0xffff) {
+        Log2(PCSC_LOG_ERROR, "Invalid port: %lu", port);
+        return -1;
+    }
+
+    if (!host) {
+        if (!lock(slot_lock[slot]))
+            return -1;
+        old_ctx = ctx[slot];
+        unchanged = old_ctx && !old_ctx->hostname
+            && old_ctx->port == port;
+        unlock(slot_lock[slot]);
+        if (unchanged) {
+            Log3(PCSC_LOG_INFO, "Slot %zu already uses %s", slot, device_name);
+            return 0;
+        }
+    }
+
+    new_ctx = vicc_init(host, (unsigned short) port);
+    if (!new_ctx) {
+        Log2(PCSC_LOG_ERROR, "Could not initialize connection to %s",
+                device_name);
+        return -1;
+    }
+
+    /* wait for a running command to finish */
+    if (!lock(slot_lock[slot])) {
+        vicc_exit(new_ctx);
+        return -1;
+    }
+    vicc_monitor_remove(slot);
+    old_ctx = ctx[slot];
+    ctx[slot] = new_ctx;
+    maxinput[slot] = 0;
+    vicc_monitor_add(slot, new_ctx);
+    unlock(slot_lock[slot]);
+
+    if (vicc_exit(old_ctx) < 0)
+        Log1(PCSC_LOG_ERROR, "Could not close connection to virtual ICC");
+    Log3(PCSC_LOG_INFO, "Slot %zu now uses %s", slot, device_name);
+
+    return 0;
+}
+
+static RESPONSECODE
+create_channel (DWORD Lun, const char *host, unsigned short port)
+{
+    size_t slot = Lun & 0xffff;
+    if (slot >= vicc_max_slots) {
+        return IFD_COMMUNICATION_ERROR;
+    }
+    if (!host)
+        Log2(PCSC_LOG_INFO, "Waiting for virtual ICC on port %hu", port);
+    slot_lock[slot] = create_lock();
+    if (!slot_lock[slot]) {
+        Log1(PCSC_LOG_ERROR, "Could not initialize lock");
+        return IFD_COMMUNICATION_ERROR;
+    }
+    ctx[slot] = vicc_init(host, port);
+    if (!ctx[slot]) {
+        Log1(PCSC_LOG_ERROR, "Could not initialize connection to virtual ICC");
+        free_lock(slot_lock[slot]);
+        slot_lock[slot] = NULL;
+        return IFD_COMMUNICATION_ERROR;
+    }
+    if (host)
+        Log3(PCSC_LOG_INFO, "Connected to virtual ICC on %s port %hu",
+                host, port);
+    if (vicc_monitor_add(slot, ctx[slot]))
+        Log2(PCSC_LOG_DEBUG, "Watching slot %zu for virtual ICC events", slot);
+    if (vicc_control_add(slot, slot_repoint))
+        Log2(PCSC_LOG_DEBUG, "Slot %zu can be re-pointed via control socket", slot);
+    vicc_trace(Lun, VICC_TRACE_CREATE, NULL, 0);
+    vicc_trace_start(trace_sink);
+
+    return IFD_SUCCESS;
+}
+
+RESPONSECODE
+IFDHCreateChannel (DWORD Lun, DWORD Channel)
+{
+    return create_channel(Lun, hostname,
+            (unsigned short) (Channel + (Lun & 0xffff)));
+}
+
+RESPONSECODE
+vicc_create_channel (DWORD Lun, const char *device_name)
+{
+    char _hostname[MAX_READERNAME];
+    const char *host = NULL;
+    unsigned long int port = VPCDPORT;
+
+    if (parse_device_name(device_name, _hostname, sizeof _hostname,
+                &host, &port) != 0)
+        return IFD_COMMUNICATION_ERROR;
+    if (port > 0xffff) {
+        Log2(PCSC_LOG_ERROR, "Invalid port: %lu", port);
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    return create_channel(Lun, host, (unsigned short) port);
+}
+
+RESPONSECODE
+IFDHCreateChannelByName (DWORD Lun, LPSTR DeviceName)
+{
+    RESPONSECODE r = IFD_NOT_SUPPORTED;
+    char _hostname[MAX_READERNAME];
+    unsigned long int port = VPCDPORT;
+
+    if (parse_device_name(DeviceName, _hostname, sizeof _hostname,
+                &hostname, &port) == 0)
+        r = IFDHCreateChannel (Lun, port);
 
-err:
     /* set hostname back to default in case it has been changed */
     hostname = NULL;
 
@@ -181,6 +445,66 @@ RESPONSECODE
 IFDHControl (DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength,
         PUCHAR RxBuffer, DWORD RxLength, LPDWORD pdwBytesReturned)
 {
+    struct vicc_trace_record *records;
+    size_t count;
+
+    if (dwControlCode == VPCD_CTL_GET_TRACE) {
+        if (!RxBuffer || !pdwBytesReturned) {
+            Log1(PCSC_LOG_ERROR, "Invalid input data");
+            return IFD_COMMUNICATION_ERROR;
+        }
+
+        /* RxBuffer is not necessarily aligned, so copy via a local buffer */
+        count = RxLength / sizeof *records;
+        records = malloc(count * sizeof *records);
+        if (count && !records) {
+            Log1(PCSC_LOG_ERROR, "Not enough memory for trace records");
+            return IFD_COMMUNICATION_ERROR;
+        }
+        count = vicc_trace_dump(records, count);
+        memcpy(RxBuffer, records, count * sizeof *records);
+        free(records);
+
+        *pdwBytesReturned = count * sizeof *records;
+        return IFD_SUCCESS;
+    }
+
+    if (dwControlCode == CM_IOCTL_GET_FEATURE_REQUEST) {
+        uint32_t ioctl = IOCTL_FEATURE_GET_TLV_PROPERTIES;
+        if (!RxBuffer || !pdwBytesReturned || RxLength < 6) {
+            Log1(PCSC_LOG_ERROR, "Invalid input data");
+            return IFD_COMMUNICATION_ERROR;
+        }
+        /* PCSC_TLV_STRUCTURE with the ioctl in big endian */
+        RxBuffer[0] = FEATURE_GET_TLV_PROPERTIES;
+        RxBuffer[1] = 4;
+        RxBuffer[2] = (ioctl >> 24) & 0xff;
+        RxBuffer[3] = (ioctl >> 16) & 0xff;
+        RxBuffer[4] = (ioctl >> 8) & 0xff;
+        RxBuffer[5] = ioctl & 0xff;
+        *pdwBytesReturned = 6;
+        return IFD_SUCCESS;
+    }
+
+    if (dwControlCode == IOCTL_FEATURE_GET_TLV_PROPERTIES) {
+        uint32_t size;
+        if (!RxBuffer || !pdwBytesReturned || RxLength < 6
+                || (Lun & 0xffff) >= vicc_max_slots) {
+            Log1(PCSC_LOG_ERROR, "Invalid input data");
+            return IFD_COMMUNICATION_ERROR;
+        }
+        /* maximum size of the command data, values are in little endian */
+        size = get_maxinput(Lun) > VICC_MAX_SHORT_APDU ? 0xffff : 0xff;
+        RxBuffer[0] = PCSCv2_PART10_PROPERTY_dwMaxAPDUDataSize;
+        RxBuffer[1] = 4;
+        RxBuffer[2] = size & 0xff;
+        RxBuffer[3] = (size >> 8) & 0xff;
+        RxBuffer[4] = (size >> 16) & 0xff;
+        RxBuffer[5] = (size >> 24) & 0xff;
+        *pdwBytesReturned = 6;
+        return IFD_SUCCESS;
+    }
+
     Log9(PCSC_LOG_DEBUG, "IFDHControl not supported (Lun=%u ControlCode=%u TxBuffer=%p TxLength=%u RxBuffer=%p RxLength=%u pBytesReturned=%p)%s",
             (unsigned int) Lun, (unsigned int) dwControlCode,
             (unsigned char *) TxBuffer, (unsigned int) TxLength,
@@ -198,6 +522,13 @@ IFDHCloseChannel (DWORD Lun)
     if (slot >= vicc_max_slots) {
         return IFD_COMMUNICATION_ERROR;
     }
+    vicc_control_remove(slot);
+    vicc_monitor_remove(slot);
+    maxinput[slot] = 0;
+    vicc_trace(Lun, VICC_TRACE_CLOSE, NULL, 0);
+    vicc_trace_stop();
+    free_lock(slot_lock[slot]);
+    slot_lock[slot] = NULL;
     if (vicc_exit(ctx[slot]) < 0) {
         Log1(PCSC_LOG_ERROR, "Could not close connection to virtual ICC");
         return IFD_COMMUNICATION_ERROR;
@@ -224,7 +555,13 @@ IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
     switch (Tag) {
         case TAG_IFD_ATR:
 
+            if (!slot_acquire(slot))
+                goto err;
             size = vicc_getatr(ctx[slot], &atr);
+            if (size > 0)
+                maxinput[slot] = atr_extended_length(atr, size) ?
+                    VICC_MAX_EXTENDED_APDU : VICC_MAX_SHORT_APDU;
+            slot_release(slot);
             if (size < 0) {
                 Log1(PCSC_LOG_ERROR, "could not get ATR");
                 goto err;
@@ -252,6 +589,18 @@ IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
             free(atr);
             break;
 
+        case SCARD_ATTR_MAXINPUT:
+            if (*Length < sizeof maxinput[slot]) {
+                Log1(PCSC_LOG_ERROR, "Invalid input data");
+                goto err;
+            }
+            {
+                uint32_t value = get_maxinput(Lun);
+                memcpy(Value, &value, sizeof value);
+                *Length = sizeof value;
+            }
+            break;
+
         case TAG_IFD_SLOTS_NUMBER:
             if (*Length < 1) {
                 Log1(PCSC_LOG_ERROR, "Invalid input data");
@@ -286,6 +635,48 @@ IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
             *Length = 1;
             break;
 
+#if defined(ENABLE_PRESENCE_MONITOR) && defined(TAG_IFD_POLLING_THREAD_WITH_TIMEOUT)
+        case TAG_IFD_POLLING_THREAD_WITH_TIMEOUT:
+            if (vicc_monitor_present(slot) < 0) {
+                /* slot is not watched, let pcscd poll */
+                r = IFD_ERROR_TAG;
+                goto err;
+            }
+            {
+                RESPONSECODE (*polling)(DWORD, int) = IFDHPolling;
+                if (*Length < sizeof polling) {
+                    Log1(PCSC_LOG_ERROR, "Invalid input data");
+                    goto err;
+                }
+                memcpy(Value, &polling, sizeof polling);
+                *Length = sizeof polling;
+            }
+            break;
+
+        case TAG_IFD_POLLING_THREAD_KILLABLE:
+            if (*Length < 1) {
+                Log1(PCSC_LOG_ERROR, "Invalid input data");
+                goto err;
+            }
+
+            /* use TAG_IFD_STOP_POLLING_THREAD instead */
+            *Value  = 0;
+            *Length = 1;
+            break;
+
+        case TAG_IFD_STOP_POLLING_THREAD:
+            {
+                RESPONSECODE (*stop)(DWORD) = IFDHStopPolling;
+                if (*Length < sizeof stop) {
+                    Log1(PCSC_LOG_ERROR, "Invalid input data");
+                    goto err;
+                }
+                memcpy(Value, &stop, sizeof stop);
+                *Length = sizeof stop;
+            }
+            break;
+#endif
+
         default:
             Log2(PCSC_LOG_DEBUG, "unknown tag %d", (int)Tag);
             r = IFD_ERROR_TAG;
@@ -324,6 +715,7 @@ RESPONSECODE
 IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 {
     size_t slot = Lun & 0xffff;
+    int status;
     RESPONSECODE r = IFD_COMMUNICATION_ERROR;
 
     if (slot >= vicc_max_slots) {
@@ -332,7 +724,12 @@ IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 
     switch (Action) {
         case IFD_POWER_DOWN:
-            if (vicc_poweroff(ctx[slot]) < 0) {
+            vicc_trace(Lun, VICC_TRACE_POWER_DOWN, NULL, 0);
+            if (!slot_acquire(slot))
+                goto err;
+            status = vicc_poweroff(ctx[slot]);
+            slot_release(slot);
+            if (status < 0) {
                 Log1(PCSC_LOG_ERROR, "could not powerdown");
                 goto err;
             }
@@ -344,13 +741,23 @@ IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 #endif
             return IFD_SUCCESS;
         case IFD_POWER_UP:
-            if (vicc_poweron(ctx[slot]) < 0) {
+            vicc_trace(Lun, VICC_TRACE_POWER_UP, NULL, 0);
+            if (!slot_acquire(slot))
+                goto err;
+            status = vicc_poweron(ctx[slot]);
+            slot_release(slot);
+            if (status < 0) {
                 Log1(PCSC_LOG_ERROR, "could not powerup");
                 goto err;
             }
             break;
         case IFD_RESET:
-            if (vicc_reset(ctx[slot]) < 0) {
+            vicc_trace(Lun, VICC_TRACE_RESET, NULL, 0);
+            if (!slot_acquire(slot))
+                goto err;
+            status = vicc_reset(ctx[slot]);
+            slot_release(slot);
+            if (status < 0) {
                 Log1(PCSC_LOG_ERROR, "could not reset");
                 goto err;
             }
@@ -377,7 +784,6 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer,
         DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength,
         PSCARD_IO_HEADER RecvPci)
 {
-    unsigned char *rapdu = NULL;
     ssize_t size;
     RESPONSECODE r = IFD_COMMUNICATION_ERROR;
     size_t slot = Lun & 0xffff;
@@ -391,20 +797,32 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer,
         goto err;
     }
 
-    size = vicc_transmit(ctx[slot], TxLength, TxBuffer, &rapdu);
+    vicc_trace(Lun, VICC_TRACE_CAPDU, TxBuffer, TxLength);
+    if (!slot_acquire(slot))
+        goto err;
+    /* receive directly into the caller's buffer */
+    size = vicc_transmit_into(ctx[slot], TxLength, TxBuffer, *RxLength,
+            RxBuffer);
+    slot_release(slot);
 
     if (size < 0) {
+        vicc_trace(Lun, VICC_TRACE_ERROR, NULL, 0);
         Log1(PCSC_LOG_ERROR, "could not send apdu or receive rapdu");
         goto err;
     }
 
     if (*RxLength < size) {
-        Log1(PCSC_LOG_ERROR, "Not enough memory for rapdu");
+        vicc_trace(Lun, VICC_TRACE_ERROR, NULL, 0);
+        Log3(PCSC_LOG_ERROR, "Not enough memory for rapdu (have %lu, need %zd)",
+                (unsigned long) *RxLength, size);
+#ifdef IFD_ERROR_INSUFFICIENT_BUFFER
+        r = IFD_ERROR_INSUFFICIENT_BUFFER;
+#endif
         goto err;
     }
 
+    vicc_trace(Lun, VICC_TRACE_RAPDU, RxBuffer, size);
     *RxLength = size;
-    memcpy(RxBuffer, rapdu, size);
     RecvPci->Protocol = 1;
 
     r = IFD_SUCCESS;
@@ -413,8 +831,6 @@ err:
     if (r != IFD_SUCCESS && RxLength)
         *RxLength = 0;
 
-    free(rapdu);
-
     return r;
 }
 
@@ -422,10 +838,17 @@ RESPONSECODE
 IFDHICCPresence (DWORD Lun)
 {
     size_t slot = Lun & 0xffff;
+    int present;
     if (slot >= vicc_max_slots) {
         return IFD_COMMUNICATION_ERROR;
     }
-    switch (vicc_present(ctx[slot])) {
+    /* the presence monitor already knows whether vicc is connected */
+    present = vicc_monitor_present(slot);
+    if (present < 0 && slot_acquire(slot)) {
+        present = vicc_present(ctx[slot]);
+        slot_release(slot);
+    }
+    switch (present) {
         case 0:
             return IFD_ICC_NOT_PRESENT;
         case 1:
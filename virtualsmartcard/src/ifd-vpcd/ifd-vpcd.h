@@ -19,6 +19,9 @@
 #ifndef _IFD_VPCD_H_
 #define _IFD_VPCD_H_
 
+#include <wintypes.h>
+#include <ifdhandler.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -26,6 +29,26 @@ extern "C" {
 extern const unsigned char vicc_max_slots;
 extern const char *hostname;
 
+/** Control code for reading the most recent trace records (see \a
+ * vicc_trace_record) with \a SCardControl. Corresponds to
+ * SCARD_CTL_CODE(3700) of PCSC-Lite. */
+#define VPCD_CTL_GET_TRACE (0x42000000 + 3700)
+
+/**
+ * @brief Create the channel of a slot for an endpoint
+ *
+ * In contrast to \a IFDHCreateChannelByName, the port is used as given, i.e.
+ * the slot number is not added.
+ *
+ * @param[in] Lun         Logical unit number of the slot
+ * @param[in] device_name Endpoint in the same format as \c DEVICENAME in
+ *                        reader.conf, i.e. \c /dev/null:port, \c host:port or
+ *                        \c unix:path
+ *
+ * @return \c IFD_SUCCESS or \c IFD_COMMUNICATION_ERROR
+ */
+RESPONSECODE vicc_create_channel(DWORD Lun, const char *device_name);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,585 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "monitor.h"
+
+#ifdef ENABLE_PRESENCE_MONITOR
+
+#include "lock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef INVALID_SOCKET
+#define INVALID_SOCKET -1
+#endif
+
+/* pcscd allows at most 16 slots per reader */
+#define MONITOR_MAX_SLOTS 16
+/* interval for retrying to connect to a vicc started with --reversed */
+#define MONITOR_RECONNECT_MS 1000
+
+/* the epoll data holds the slot in the lower bits and the socket's type in
+ * the upper bits */
+#define MONITOR_EV_SLOT   0x0000ffff
+#define MONITOR_EV_LISTEN 0x00010000
+#define MONITOR_EV_CLIENT 0x00020000
+#define MONITOR_EV_WAKEUP 0x00040000
+
+struct monitor_slot {
+    struct vicc_ctx *ctx;
+    /* duplicate of ctx->client_sock, which is registered with epoll. The
+     * duplicate stays valid if ctx->client_sock is closed by vicc_eject, so
+     * that we get notified by the shutdown of the connection. */
+    int watch_fd;
+    /* ctx->connection of the watched connection */
+    unsigned long connection;
+    /* counts insertions and removals */
+    unsigned long events;
+    unsigned long cancels;
+    /* set while the monitor thread works with ctx outside of the mutex */
+    int busy;
+};
+
+static struct monitor_slot slots[MONITOR_MAX_SLOTS];
+static unsigned long present_slots = 0;
+/* counts insertions and removals on all slots as well as calls to
+ * vicc_monitor_cancel_all */
+static unsigned long changes = 0;
+static size_t slot_count = 0;
+static int running = 0;
+static int epfd = -1;
+static int wakeup[2] = {-1, -1};
+static pthread_t thread;
+/* protects all of the above */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/* serializes starting and stopping the monitor thread */
+static pthread_mutex_t control = PTHREAD_MUTEX_INITIALIZER;
+
+#define SLOT_BIT(slot) (1UL << (slot))
+
+static void set_present(size_t slot, int present)
+{
+    int changed = ((present_slots & SLOT_BIT(slot)) != 0) != (present != 0);
+
+    if (present)
+        present_slots |= SLOT_BIT(slot);
+    else
+        present_slots &= ~SLOT_BIT(slot);
+
+    if (changed) {
+        slots[slot].events++;
+        changes++;
+        pthread_cond_broadcast(&cond);
+    }
+}
+
+static void arm_listen(struct vicc_ctx *ctx, size_t slot, int op)
+{
+    struct epoll_event ev;
+
+    if (ctx->server_sock == INVALID_SOCKET)
+        return;
+
+    ev.events = EPOLLIN|EPOLLONESHOT;
+    ev.data.u32 = MONITOR_EV_LISTEN | slot;
+    epoll_ctl(epfd, op, ctx->server_sock, &ev);
+}
+
+static struct vicc_ctx *slot_acquire(size_t slot)
+{
+    struct vicc_ctx *ctx;
+
+    pthread_mutex_lock(&mutex);
+    ctx = slots[slot].ctx;
+    if (ctx)
+        slots[slot].busy = 1;
+    pthread_mutex_unlock(&mutex);
+
+    return ctx;
+}
+
+/* must be called with the mutex held */
+static void slot_release(size_t slot)
+{
+    slots[slot].busy = 0;
+    pthread_cond_broadcast(&cond);
+}
+
+static void slot_connect(size_t slot)
+{
+    struct epoll_event ev;
+    struct vicc_ctx *ctx;
+    unsigned long connection = 0;
+    int fd = -1;
+
+    ctx = slot_acquire(slot);
+    if (!ctx)
+        return;
+
+    if (slots[slot].watch_fd < 0 && lock(ctx->io_lock)) {
+        /* accept a waiting vicc or connect to a vicc started with --reversed */
+        if (vicc_connect(ctx, 0, 0)) {
+            connection = ctx->connection;
+            fd = dup(ctx->client_sock);
+            if (fd < 0)
+                vicc_eject(ctx);
+        }
+        unlock(ctx->io_lock);
+    }
+
+    if (fd >= 0) {
+        ev.events = EPOLLRDHUP;
+        ev.data.u32 = MONITOR_EV_CLIENT | slot;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            fd = -1;
+            if (lock(ctx->io_lock)) {
+                vicc_eject(ctx);
+                unlock(ctx->io_lock);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (fd >= 0) {
+        slots[slot].watch_fd = fd;
+        slots[slot].connection = connection;
+        set_present(slot, 1);
+    } else if (slots[slot].watch_fd < 0) {
+        arm_listen(ctx, slot, EPOLL_CTL_MOD);
+    }
+    slot_release(slot);
+    pthread_mutex_unlock(&mutex);
+}
+
+static void slot_disconnect(size_t slot)
+{
+    struct vicc_ctx *ctx;
+    unsigned long connection;
+    int fd;
+
+    ctx = slot_acquire(slot);
+    if (!ctx)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    fd = slots[slot].watch_fd;
+    connection = slots[slot].connection;
+    slots[slot].watch_fd = -1;
+    pthread_mutex_unlock(&mutex);
+
+    if (fd >= 0)
+        /* implicitly removes the socket from epoll */
+        close(fd);
+
+    if (lock(ctx->io_lock)) {
+        /* only close the connection if it has not been replaced, yet */
+        if (ctx->connection == connection)
+            vicc_eject(ctx);
+        unlock(ctx->io_lock);
+    }
+
+    pthread_mutex_lock(&mutex);
+    set_present(slot, 0);
+    arm_listen(ctx, slot, EPOLL_CTL_MOD);
+    slot_release(slot);
+    pthread_mutex_unlock(&mutex);
+}
+
+/* retry slots that connect to a vicc instead of waiting for it */
+static int reconnect(void)
+{
+    size_t slot;
+    int pending = 0;
+
+    for (slot = 0; slot < MONITOR_MAX_SLOTS; slot++) {
+        pthread_mutex_lock(&mutex);
+        pending = slots[slot].ctx
+            && slots[slot].ctx->server_sock == INVALID_SOCKET
+            && slots[slot].watch_fd < 0;
+        pthread_mutex_unlock(&mutex);
+
+        if (pending)
+            slot_connect(slot);
+    }
+
+    pending = 0;
+    pthread_mutex_lock(&mutex);
+    for (slot = 0; slot < MONITOR_MAX_SLOTS; slot++) {
+        if (slots[slot].ctx
+                && slots[slot].ctx->server_sock == INVALID_SOCKET
+                && slots[slot].watch_fd < 0)
+            pending = 1;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return pending;
+}
+
+static void *monitor_thread(void *arg)
+{
+    struct epoll_event events[2*MONITOR_MAX_SLOTS+1];
+    char c;
+    int i, n, timeout;
+    uint32_t data;
+
+    (void) arg;
+
+    timeout = reconnect() ? MONITOR_RECONNECT_MS : -1;
+
+    while (1) {
+        n = epoll_wait(epfd, events, sizeof events/sizeof *events, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            data = events[i].data.u32;
+            if (data & MONITOR_EV_WAKEUP) {
+                while (read(wakeup[0], &c, sizeof c) > 0)
+                    ;
+                pthread_mutex_lock(&mutex);
+                if (!running) {
+                    pthread_mutex_unlock(&mutex);
+                    return NULL;
+                }
+                pthread_mutex_unlock(&mutex);
+            } else if (data & MONITOR_EV_LISTEN) {
+                slot_connect(data & MONITOR_EV_SLOT);
+            } else if (data & MONITOR_EV_CLIENT) {
+                slot_disconnect(data & MONITOR_EV_SLOT);
+            }
+        }
+
+        timeout = reconnect() ? MONITOR_RECONNECT_MS : -1;
+    }
+
+    return NULL;
+}
+
+static void monitor_notify(void)
+{
+    char c = 0;
+    if (write(wakeup[1], &c, sizeof c) < 0) {
+        /* the pipe is full, so the thread will wake up anyway */
+    }
+}
+
+/* must be called with control held */
+static int monitor_start(void)
+{
+    struct epoll_event ev;
+
+    epfd = epoll_create(2*MONITOR_MAX_SLOTS+1);
+    if (epfd < 0)
+        goto err;
+
+    if (pipe(wakeup) != 0
+            || fcntl(wakeup[0], F_SETFL, O_NONBLOCK) != 0
+            || fcntl(wakeup[1], F_SETFL, O_NONBLOCK) != 0)
+        goto err;
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = MONITOR_EV_WAKEUP;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakeup[0], &ev) != 0)
+        goto err;
+
+    running = 1;
+    if (pthread_create(&thread, NULL, monitor_thread, NULL) != 0) {
+        running = 0;
+        goto err;
+    }
+
+    return 1;
+
+err:
+    if (epfd >= 0)
+        close(epfd);
+    if (wakeup[0] >= 0)
+        close(wakeup[0]);
+    if (wakeup[1] >= 0)
+        close(wakeup[1]);
+    epfd = wakeup[0] = wakeup[1] = -1;
+
+    return 0;
+}
+
+/* must be called with control held */
+static void monitor_stop(void)
+{
+    pthread_mutex_lock(&mutex);
+    running = 0;
+    pthread_mutex_unlock(&mutex);
+
+    monitor_notify();
+    pthread_join(thread, NULL);
+
+    close(epfd);
+    close(wakeup[0]);
+    close(wakeup[1]);
+    epfd = wakeup[0] = wakeup[1] = -1;
+}
+
+int vicc_monitor_add(size_t slot, struct vicc_ctx *ctx)
+{
+    int r = 0;
+
+    if (slot >= MONITOR_MAX_SLOTS || !ctx)
+        return 0;
+
+    pthread_mutex_lock(&control);
+
+    if (slots[slot].ctx)
+        goto err;
+
+    if (!slot_count && !monitor_start())
+        goto err;
+
+    pthread_mutex_lock(&mutex);
+    slots[slot].ctx = ctx;
+    slots[slot].watch_fd = -1;
+    slots[slot].connection = 0;
+    slots[slot].busy = 0;
+    present_slots &= ~SLOT_BIT(slot);
+    arm_listen(ctx, slot, EPOLL_CTL_ADD);
+    slot_count++;
+    pthread_mutex_unlock(&mutex);
+
+    /* let the thread pick up slots that connect to vicc */
+    monitor_notify();
+
+    r = 1;
+
+err:
+    pthread_mutex_unlock(&control);
+
+    return r;
+}
+
+void vicc_monitor_remove(size_t slot)
+{
+    struct vicc_ctx *ctx;
+    int stop = 0;
+
+    if (slot >= MONITOR_MAX_SLOTS)
+        return;
+
+    pthread_mutex_lock(&control);
+    pthread_mutex_lock(&mutex);
+
+    ctx = slots[slot].ctx;
+    if (ctx) {
+        slots[slot].ctx = NULL;
+        while (slots[slot].busy)
+            pthread_cond_wait(&cond, &mutex);
+
+        if (ctx->server_sock != INVALID_SOCKET)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, ctx->server_sock, NULL);
+        if (slots[slot].watch_fd >= 0)
+            close(slots[slot].watch_fd);
+        slots[slot].watch_fd = -1;
+
+        /* wakes up everybody waiting for this slot */
+        set_present(slot, 0);
+        slots[slot].cancels++;
+        pthread_cond_broadcast(&cond);
+
+        slot_count--;
+        if (!slot_count)
+            stop = 1;
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    if (stop)
+        monitor_stop();
+
+    pthread_mutex_unlock(&control);
+}
+
+int vicc_monitor_present(size_t slot)
+{
+    int r = -1;
+
+    if (slot >= MONITOR_MAX_SLOTS)
+        return -1;
+
+    pthread_mutex_lock(&mutex);
+    if (slots[slot].ctx)
+        r = (present_slots & SLOT_BIT(slot)) ? 1 : 0;
+    pthread_mutex_unlock(&mutex);
+
+    return r;
+}
+
+static void get_deadline(struct timespec *deadline, int timeout)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    deadline->tv_sec = now.tv_sec + timeout/1000;
+    deadline->tv_nsec = now.tv_usec*1000 + (timeout%1000)*1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+int vicc_monitor_wait(size_t slot, int timeout)
+{
+    struct timespec deadline;
+    unsigned long events, cancels;
+    int r = -1;
+
+    if (slot >= MONITOR_MAX_SLOTS)
+        return -1;
+
+    if (timeout >= 0)
+        get_deadline(&deadline, timeout);
+
+    pthread_mutex_lock(&mutex);
+    if (slots[slot].ctx) {
+        r = 0;
+        events = slots[slot].events;
+        cancels = slots[slot].cancels;
+        while (slots[slot].ctx
+                && events == slots[slot].events
+                && cancels == slots[slot].cancels) {
+            if (timeout < 0) {
+                pthread_cond_wait(&cond, &mutex);
+            } else if (ETIMEDOUT == pthread_cond_timedwait(&cond, &mutex,
+                        &deadline)) {
+                break;
+            }
+        }
+        if (events != slots[slot].events)
+            r = 1;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return r;
+}
+
+void vicc_monitor_cancel(size_t slot)
+{
+    if (slot >= MONITOR_MAX_SLOTS)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    slots[slot].cancels++;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+unsigned long vicc_monitor_changes(void)
+{
+    unsigned long r;
+
+    pthread_mutex_lock(&mutex);
+    r = changes;
+    pthread_mutex_unlock(&mutex);
+
+    return r;
+}
+
+int vicc_monitor_wait_changes(unsigned long seen, int timeout)
+{
+    struct timespec deadline;
+    int r = -1;
+
+    if (timeout >= 0)
+        get_deadline(&deadline, timeout);
+
+    pthread_mutex_lock(&mutex);
+    if (slot_count) {
+        while (slot_count && changes == seen) {
+            if (timeout < 0) {
+                pthread_cond_wait(&cond, &mutex);
+            } else if (ETIMEDOUT == pthread_cond_timedwait(&cond, &mutex,
+                        &deadline)) {
+                break;
+            }
+        }
+        r = changes != seen ? 1 : 0;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return r;
+}
+
+void vicc_monitor_cancel_all(void)
+{
+    pthread_mutex_lock(&mutex);
+    changes++;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+#else
+
+int vicc_monitor_add(size_t slot, struct vicc_ctx *ctx)
+{
+    return 0;
+}
+
+void vicc_monitor_remove(size_t slot)
+{
+}
+
+int vicc_monitor_present(size_t slot)
+{
+    return -1;
+}
+
+int vicc_monitor_wait(size_t slot, int timeout)
+{
+    return -1;
+}
+
+void vicc_monitor_cancel(size_t slot)
+{
+}
+
+unsigned long vicc_monitor_changes(void)
+{
+    return 0;
+}
+
+int vicc_monitor_wait_changes(unsigned long seen, int timeout)
+{
+    return -1;
+}
+
+void vicc_monitor_cancel_all(void)
+{
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _MONITOR_H_
+#define _MONITOR_H_
+
+#include "vpcd.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Start watching the sockets of a slot
+ *
+ * The first call starts a background thread, which accepts (or re-connects)
+ * virtual ICCs and keeps track of their presence. The thread is stopped when
+ * the last slot is removed.
+ *
+ * @param[in] slot Index of the slot
+ * @param[in] ctx  Initialized connection of the slot
+ *
+ * @return On success, the call returns 1. If monitoring is not available, 0 is
+ *         returned and the caller should fall back to polling.
+ */
+int vicc_monitor_add(size_t slot, struct vicc_ctx *ctx);
+
+/**
+ * @brief Stop watching the sockets of a slot
+ *
+ * Must be called before the slot's connection is closed with \a vicc_exit.
+ */
+void vicc_monitor_remove(size_t slot);
+
+/**
+ * @brief Get the presence of a virtual ICC without any network round trip
+ *
+ * @return 1 if a virtual ICC is connected, 0 if not, -1 if the slot is not
+ *         monitored.
+ */
+int vicc_monitor_present(size_t slot);
+
+/**
+ * @brief Wait for a virtual ICC to be inserted or removed
+ *
+ * @param[in] slot    Index of the slot
+ * @param[in] timeout Maximum time to wait in milliseconds, -1 for infinity
+ *
+ * @return 1 if the presence changed, 0 on timeout or cancellation, -1 if the
+ *         slot is not monitored.
+ */
+int vicc_monitor_wait(size_t slot, int timeout);
+
+/**
+ * @brief Wake up all threads waiting in \a vicc_monitor_wait on a slot
+ */
+void vicc_monitor_cancel(size_t slot);
+
+/**
+ * @brief Get a counter of all insertions and removals
+ *
+ * The counter also changes with every call to \a vicc_monitor_cancel_all.
+ */
+unsigned long vicc_monitor_changes(void);
+
+/**
+ * @brief Wait for a virtual ICC to be inserted or removed on any slot
+ *
+ * @param[in] seen    Value of \a vicc_monitor_changes the caller has seen
+ * @param[in] timeout Maximum time to wait in milliseconds, -1 for infinity
+ *
+ * @return 1 if the counter differs from \a seen, 0 on timeout, -1 if no slot
+ *         is monitored.
+ */
+int vicc_monitor_wait_changes(unsigned long seen, int timeout);
+
+/**
+ * @brief Wake up all threads waiting in \a vicc_monitor_wait_changes
+ */
+void vicc_monitor_cancel_all(void);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Latency of SCardTransmit with vpcd: The benchmark is linked against the
+ * configured PC/SC library, i.e. either PCSC-Lite talking to pcscd, which has
+ * loaded ifd-vpcd, or our standalone libpcsclite. An embedded virtual ICC
+ * connects to vpcd and answers every command APDU with a fixed response.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "vpcd.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <winscard.h>
+
+#if (!defined HAVE_DECL_MSG_NOSIGNAL) || !HAVE_DECL_MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define BENCH_READER "Virtual PCD 00"
+
+static unsigned short port = VPCDPORT;
+static size_t response_size = 0;
+
+static const unsigned char atr[] = {0x3B, 0x80, 0x80, 0x01, 0x01};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* embedded virtual ICC */
+
+static ssize_t recv_all(int sock, unsigned char *buf, size_t len)
+{
+    size_t received;
+    ssize_t r;
+
+    for (received = 0; received < len; received += r) {
+        r = recv(sock, buf + received, len - received, 0);
+        if (r <= 0)
+            return -1;
+    }
+
+    return received;
+}
+
+static int send_msg(int sock, unsigned char *buf, size_t len)
+{
+    /* length and data are sent in one go */
+    buf[0] = (len >> 8) & 0xff;
+    buf[1] = len & 0xff;
+    return send(sock, buf, len + 2, MSG_NOSIGNAL) == (ssize_t) (len + 2) ?
+        0 : -1;
+}
+
+static void *vicc_thread(void *arg)
+{
+    struct sockaddr_in addr;
+    unsigned char *buf;
+    size_t len;
+    int sock = -1, yes = 1, i;
+
+    buf = malloc(2 + 0xffff + 2);
+    if (!buf)
+        goto err;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (i = 0; i < 500; i++) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0)
+            goto err;
+        if (connect(sock, (struct sockaddr *) &addr, sizeof addr) == 0)
+            break;
+        close(sock);
+        sock = -1;
+        usleep(10000);
+    }
+    if (sock < 0)
+        goto err;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+
+    while (recv_all(sock, buf, 2) == 2) {
+        len = (buf[0] << 8) | buf[1];
+        if (recv_all(sock, buf + 2, len) != (ssize_t) len)
+            break;
+
+        if (len == VPCD_CTRL_LEN) {
+            if (buf[2] == VPCD_CTRL_ATR) {
+                memcpy(buf + 2, atr, sizeof atr);
+                if (send_msg(sock, buf, sizeof atr) != 0)
+                    break;
+            }
+            continue;
+        }
+
+        /* response data followed by 90 00 */
+        memset(buf + 2, 0xAB, response_size);
+        buf[2 + response_size] = 0x90;
+        buf[2 + response_size + 1] = 0x00;
+        if (send_msg(sock, buf, response_size + 2) != 0)
+            break;
+    }
+
+err:
+    if (sock >= 0)
+        close(sock);
+    free(buf);
+
+    return NULL;
+}
+
+static LONG wait_for_card(SCARDCONTEXT hContext, const char *reader)
+{
+    SCARD_READERSTATE state;
+    LONG r;
+    int i;
+
+    memset(&state, 0, sizeof state);
+    state.szReader = reader;
+    state.dwCurrentState = SCARD_STATE_UNAWARE;
+
+    for (i = 0; i < 50; i++) {
+        r = SCardGetStatusChange(hContext, 100, &state, 1);
+        if (r != SCARD_S_SUCCESS && r != SCARD_E_TIMEOUT)
+            return r;
+        if (state.dwEventState & SCARD_STATE_PRESENT)
+            return SCARD_S_SUCCESS;
+        state.dwCurrentState = state.dwEventState & ~SCARD_STATE_CHANGED;
+    }
+
+    return SCARD_E_NO_SMARTCARD;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-r reader] [-p port] [-n apdus] [-z size] [-e]\n"
+            "  -r reader   reader to use (default \"%s\")\n"
+            "  -p port     port of the reader's vpcd (default %d)\n"
+            "  -n apdus    APDUs to transmit (default 10000)\n"
+            "  -z size     size of the response data (default 0)\n"
+            "  -e          use an external virtual ICC\n",
+            argv0, BENCH_READER, VPCDPORT);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *reader = BENCH_READER;
+    unsigned long apdus = 10000, i, failed = 0;
+    unsigned long long start, elapsed, sum = 0, *latency = NULL;
+    unsigned char capdu[] = {0x00, 0xB0, 0x00, 0x00, 0x00};
+    unsigned char *rapdu = NULL;
+    DWORD rapdu_len, protocol;
+    SCARDCONTEXT hContext = 0;
+    SCARDHANDLE hCard = 0;
+    pthread_t vicc;
+    int opt, external = 0, r = EXIT_FAILURE;
+    LONG rv;
+
+    while ((opt = getopt(argc, argv, "r:p:n:z:eh")) != -1) {
+        switch (opt) {
+            case 'r':
+                reader = optarg;
+                break;
+            case 'p':
+                port = (unsigned short) strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                apdus = strtoul(optarg, NULL, 0);
+                break;
+            case 'z':
+                response_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'e':
+                external = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (!apdus || response_size > 0xffff - 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    capdu[4] = response_size & 0xff;
+
+    latency = malloc(apdus * sizeof *latency);
+    rapdu = malloc(0xffff + 2);
+    if (!latency || !rapdu)
+        goto err;
+
+    rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+    if (rv != SCARD_S_SUCCESS) {
+        fprintf(stderr, "SCardEstablishContext: %s\n", pcsc_stringify_error(rv));
+        goto err;
+    }
+
+    if (!external && pthread_create(&vicc, NULL, vicc_thread, NULL) != 0) {
+        fprintf(stderr, "Could not create thread\n");
+        goto err;
+    }
+
+    rv = wait_for_card(hContext, reader);
+    if (rv == SCARD_S_SUCCESS)
+        rv = SCardConnect(hContext, reader, SCARD_SHARE_SHARED,
+                SCARD_PROTOCOL_T0|SCARD_PROTOCOL_T1, &hCard, &protocol);
+    if (rv != SCARD_S_SUCCESS) {
+        fprintf(stderr, "%s: %s\n", reader, pcsc_stringify_error(rv));
+        goto err;
+    }
+
+    elapsed = now_ns();
+    for (i = 0; i < apdus; i++) {
+        rapdu_len = 0xffff + 2;
+        start = now_ns();
+        rv = SCardTransmit(hCard, SCARD_PCI_T1, capdu, sizeof capdu, NULL,
+                rapdu, &rapdu_len);
+        latency[i] = now_ns() - start;
+        sum += latency[i];
+        if (rv != SCARD_S_SUCCESS || rapdu_len != response_size + 2)
+            failed++;
+    }
+    elapsed = now_ns() - elapsed;
+
+    qsort(latency, apdus, sizeof *latency, compare);
+
+    printf("SCardTransmit:\n");
+    printf("  calls:    %lu in %.3f s (%.0f/s), %lu failed\n",
+            apdus, elapsed/1e9, apdus/(elapsed/1e9), failed);
+    printf("  latency:  min %.1f us, avg %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+            latency[0]/1e3, sum/1e3/apdus, latency[apdus/2]/1e3,
+            latency[apdus*99/100]/1e3, latency[apdus-1]/1e3);
+
+    if (!failed)
+        r = EXIT_SUCCESS;
+
+err:
+    if (hCard)
+        SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+    if (hContext)
+        /* the embedded vicc ends when vpcd closes the connection */
+        SCardReleaseContext(hContext);
+    free(rapdu);
+    free(latency);
+
+    return r;
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#ifdef HAVE_PTHREAD
+#include <errno.h>
+#include <pthread.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define fetch_and_inc(p) __sync_fetch_and_add((p), 1)
+#define barrier() __sync_synchronize()
+#else
+#define fetch_and_inc(p) ((*(p))++)
+#define barrier()
+#endif
+
+/* number of records in the ring buffer, must be a power of 2 */
+#define TRACE_SIZE 1024
+/* interval for draining the ring buffer */
+#define TRACE_DRAIN_MS 100
+
+struct trace_entry {
+    /* position of the record + 1, 0 while the record is being written */
+    volatile unsigned long seq;
+    struct vicc_trace_record record;
+};
+
+static struct trace_entry ring[TRACE_SIZE];
+static volatile unsigned long head = 0;
+
+static const char *event_names[] = {
+    "?", "create", "close", "power up", "power down", "reset",
+    "C-APDU", "R-APDU", "error",
+};
+
+void vicc_trace(uint32_t lun, int event, const unsigned char *data, size_t len)
+{
+    struct timeval tv;
+    unsigned long pos = fetch_and_inc(&head);
+    struct trace_entry *entry = &ring[pos & (TRACE_SIZE-1)];
+    struct vicc_trace_record *record = &entry->record;
+
+    entry->seq = 0;
+    barrier();
+
+    gettimeofday(&tv, NULL);
+    record->sec = (uint32_t) tv.tv_sec;
+    record->usec = (uint32_t) tv.tv_usec;
+    record->lun = lun;
+    record->event = (uint16_t) event;
+    record->length = len > 0xffff ? 0xffff : (uint16_t) len;
+    memset(record->data, 0, sizeof record->data);
+    if (data) {
+        if (event == VICC_TRACE_RAPDU) {
+            /* SW1 SW2 are the most interesting part of the response */
+            if (len >= 2)
+                memcpy(record->data, data + len - 2, 2);
+        } else {
+            memcpy(record->data, data,
+                    len < sizeof record->data ? len : sizeof record->data);
+        }
+    }
+
+    barrier();
+    entry->seq = pos + 1;
+}
+
+/* copies out records in [*tail, head), returns the number of records copied
+ * and advances *tail. *dropped receives the number of lost records. */
+static size_t trace_read(unsigned long *tail, struct vicc_trace_record *records,
+        size_t max, unsigned long *dropped)
+{
+    unsigned long pos, seq, end = head;
+    size_t n = 0;
+    struct trace_entry *entry;
+
+    if (dropped)
+        *dropped = 0;
+
+    if (end - *tail > TRACE_SIZE) {
+        if (dropped)
+            *dropped = end - *tail - TRACE_SIZE;
+        *tail = end - TRACE_SIZE;
+    }
+
+    for (pos = *tail; pos != end && n < max; pos++) {
+        entry = &ring[pos & (TRACE_SIZE-1)];
+        seq = entry->seq;
+        barrier();
+        if (seq != pos + 1) {
+            /* still being written or already overwritten */
+            if (seq == 0 || seq < pos + 1)
+                break;
+            if (dropped)
+                (*dropped)++;
+            continue;
+        }
+        records[n] = entry->record;
+        barrier();
+        if (entry->seq != seq) {
+            /* overwritten while copying */
+            if (dropped)
+                (*dropped)++;
+            continue;
+        }
+        n++;
+    }
+    *tail = pos;
+
+    return n;
+}
+
+size_t vicc_trace_dump(struct vicc_trace_record *records, size_t max)
+{
+    unsigned long tail, end = head;
+
+    if (!records)
+        return 0;
+
+    if (max > TRACE_SIZE)
+        max = TRACE_SIZE;
+    tail = end > max ? end - max : 0;
+
+    return trace_read(&tail, records, max, NULL);
+}
+
+int vicc_trace_format(const struct vicc_trace_record *record, char *buf,
+        size_t len)
+{
+    const char *name = "?";
+
+    if (!record || !buf)
+        return -1;
+
+    if (record->event < sizeof event_names/sizeof *event_names)
+        name = event_names[record->event];
+
+    switch (record->event) {
+        case VICC_TRACE_CAPDU:
+            return snprintf(buf, len,
+                    "%lu.%06lu Lun=0x%lX %s (%u bytes) %02X %02X %02X %02X",
+                    (unsigned long) record->sec, (unsigned long) record->usec,
+                    (unsigned long) record->lun, name,
+                    (unsigned int) record->length,
+                    record->data[0], record->data[1],
+                    record->data[2], record->data[3]);
+        case VICC_TRACE_RAPDU:
+            return snprintf(buf, len,
+                    "%lu.%06lu Lun=0x%lX %s (%u bytes) SW=%02X%02X",
+                    (unsigned long) record->sec, (unsigned long) record->usec,
+                    (unsigned long) record->lun, name,
+                    (unsigned int) record->length,
+                    record->data[0], record->data[1]);
+        default:
+            return snprintf(buf, len,
+                    "%lu.%06lu Lun=0x%lX %s (%u bytes)",
+                    (unsigned long) record->sec, (unsigned long) record->usec,
+                    (unsigned long) record->lun, name,
+                    (unsigned int) record->length);
+    }
+}
+
+#ifdef HAVE_PTHREAD
+
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t drain_thread;
+static size_t drain_users = 0;
+static int draining = 0;
+static void (*drain_sink)(const char *line) = NULL;
+
+static void drain(unsigned long *tail)
+{
+    struct vicc_trace_record records[64];
+    char line[128];
+    unsigned long dropped;
+    size_t i, n;
+
+    do {
+        n = trace_read(tail, records, sizeof records/sizeof *records,
+                &dropped);
+        if (dropped) {
+            snprintf(line, sizeof line, "%lu trace records dropped", dropped);
+            drain_sink(line);
+        }
+        for (i = 0; i < n; i++) {
+            vicc_trace_format(&records[i], line, sizeof line);
+            drain_sink(line);
+        }
+    } while (n == sizeof records/sizeof *records);
+}
+
+static void *drain_main(void *arg)
+{
+    struct timespec deadline;
+    struct timeval now;
+    unsigned long tail = head;
+
+    (void) arg;
+
+    pthread_mutex_lock(&drain_mutex);
+    while (draining) {
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec;
+        deadline.tv_nsec = now.tv_usec*1000 + TRACE_DRAIN_MS*1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&drain_cond, &drain_mutex, &deadline);
+
+        pthread_mutex_unlock(&drain_mutex);
+        drain(&tail);
+        pthread_mutex_lock(&drain_mutex);
+    }
+    pthread_mutex_unlock(&drain_mutex);
+
+    return NULL;
+}
+
+void vicc_trace_start(void (*sink)(const char *line))
+{
+    const char *env = getenv("VPCD_TRACE");
+
+    pthread_mutex_lock(&drain_mutex);
+    drain_users++;
+    if (!draining && sink && env && strcmp(env, "log") == 0) {
+        drain_sink = sink;
+        draining = 1;
+        if (0 != pthread_create(&drain_thread, NULL, drain_main, NULL))
+            draining = 0;
+    }
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+void vicc_trace_stop(void)
+{
+    int join = 0;
+
+    pthread_mutex_lock(&drain_mutex);
+    if (drain_users)
+        drain_users--;
+    if (!drain_users && draining) {
+        draining = 0;
+        join = 1;
+        pthread_cond_broadcast(&drain_cond);
+    }
+    pthread_mutex_unlock(&drain_mutex);
+
+    if (join)
+        pthread_join(drain_thread, NULL);
+}
+
+#else
+
+void vicc_trace_start(void (*sink)(const char *line))
+{
+}
+
+void vicc_trace_stop(void)
+{
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum vicc_trace_event {
+    VICC_TRACE_CREATE = 1,
+    VICC_TRACE_CLOSE,
+    VICC_TRACE_POWER_UP,
+    VICC_TRACE_POWER_DOWN,
+    VICC_TRACE_RESET,
+    VICC_TRACE_CAPDU,
+    VICC_TRACE_RAPDU,
+    VICC_TRACE_ERROR,
+};
+
+/** Binary trace record as returned by \a vicc_trace_dump */
+struct vicc_trace_record {
+    /** Time of the event */
+    uint32_t sec;
+    uint32_t usec;
+    /** Logical unit number of the slot */
+    uint32_t lun;
+    /** One of \a vicc_trace_event */
+    uint16_t event;
+    /** Total length of the (R-)APDU or ATR */
+    uint16_t length;
+    /** First bytes of the data, i.e. CLA INS P1 P2 of a C-APDU; the R-APDU's
+     * SW1 SW2 are found in \a data[0] and \a data[1] */
+    unsigned char data[4];
+};
+
+/**
+ * @brief Record an event in the ring buffer
+ *
+ * The call doesn't block and doesn't format anything, so that tracing can
+ * stay enabled in production. If the ring buffer is full, the oldest records
+ * are overwritten.
+ *
+ * @param[in] lun   Logical unit number of the slot
+ * @param[in] event One of \a vicc_trace_event
+ * @param[in] data  (R-)APDU or ATR, may be NULL
+ * @param[in] len   Length of \a data
+ */
+void vicc_trace(uint32_t lun, int event, const unsigned char *data, size_t len);
+
+/**
+ * @brief Copy the most recent records from the ring buffer
+ *
+ * @param[out] records Buffer for the records, oldest first
+ * @param[in]  max     Maximum number of records to copy
+ *
+ * @return Number of records copied
+ */
+size_t vicc_trace_dump(struct vicc_trace_record *records, size_t max);
+
+/**
+ * @brief Start draining the ring buffer in a background thread
+ *
+ * Only has an effect if the environment variable \c VPCD_TRACE is set to
+ * \c log. Calls are counted, the thread is stopped with the last call to
+ * \a vicc_trace_stop.
+ *
+ * @param[in] sink Called from the background thread with each formatted
+ *                 record
+ */
+void vicc_trace_start(void (*sink)(const char *line));
+void vicc_trace_stop(void);
+
+/** Format a record as human readable string */
+int vicc_trace_format(const struct vicc_trace_record *record, char *buf,
+        size_t len);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
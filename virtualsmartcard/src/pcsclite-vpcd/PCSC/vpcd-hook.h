@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 Frank Morgner
+ *
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * @brief Tracing hook of the standalone libpcsclite
+ *
+ * This is an extension of the PC/SC API, which is only available if the
+ * application is linked against the libpcsclite of virtualsmartcard.
+ */
+#ifndef _VPCD_HOOK_H_
+#define _VPCD_HOOK_H_
+
+#include <wintypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Called after each \a SCardTransmit
+ *
+ * The hook is called from the thread that called \a SCardTransmit, after the
+ * reader has been unlocked for other card handles.
+ *
+ * @param[in] hCard       Card handle passed to \a SCardTransmit
+ * @param[in] capdu       Command APDU
+ * @param[in] capdu_len   Length of \a capdu
+ * @param[in] rapdu       Response APDU or \c NULL if \a result is not
+ *                        \c SCARD_S_SUCCESS
+ * @param[in] rapdu_len   Length of \a rapdu
+ * @param[in] result      Return value of \a SCardTransmit
+ * @param[in] latency_us  Time spent in \a SCardTransmit in microseconds
+ * @param[in] data        Opaque pointer passed to \a vicc_set_apdu_hook
+ */
+typedef void (*vicc_apdu_hook)(SCARDHANDLE hCard,
+        const unsigned char *capdu, DWORD capdu_len,
+        const unsigned char *rapdu, DWORD rapdu_len,
+        LONG result, unsigned long latency_us, void *data);
+
+/**
+ * @brief Register a hook for tracing the APDUs of all card handles
+ *
+ * @param[in] hook Function to call or \c NULL to remove the current hook
+ * @param[in] data Opaque pointer passed to \a hook
+ */
+void vicc_set_apdu_hook(vicc_apdu_hook hook, void *data);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -20,32 +20,176 @@
 #include <config.h>
 #endif
 
-#ifdef _WIN32
-#define sleep(s) Sleep((s*1000))
-#endif
-
 #include "ifd-vpcd.h"
+#include "lock.h"
+#include "monitor.h"
 #include "vpcd.h"
+#include "vpcd-hook.h"
 #include <ifdhandler.h>
 #include <inttypes.h>
+#include <reader.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <winscard.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#define msleep(ms) Sleep(ms)
+#else
+#include <sys/time.h>
+#include <unistd.h>
+#define msleep(ms) usleep((ms)*1000)
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+static pthread_mutex_t globals_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define lock_globals() pthread_mutex_lock(&globals_mutex)
+#define unlock_globals() pthread_mutex_unlock(&globals_mutex)
+#else
+#define lock_globals() do { } while (0)
+#define unlock_globals() do { } while (0)
+#endif
+
+/* interval for polling the slots if the presence monitor is not available */
+#define STATUS_POLL_MS 100
+/* time to wait for an other card handle to end its transaction */
+#define TRANSACTION_TIMEOUT_MS 30000
+
+/* Latency histogram of the APDU statistics: bucket i counts the latencies
+ * below 2^i microseconds, the last bucket counts all others */
+#define STATS_LATENCY_BUCKETS 24
+/* number of distinct status words counted per card handle */
+#define STATS_SW_MAX 16
+
+/* same limits as in PCSC-Lite */
+#define MAX_CONTEXTS 16
+#define MAX_HANDLES  (MAX_CONTEXTS*PCSCLITE_MAX_READERS_CONTEXTS)
+
+/* Context and card handles consist of the table index + 1 in the lower bits
+ * and a generation counter in the upper bits, which is incremented whenever
+ * the entry is freed. The generation is limited to 15 bits so that the values
+ * stay positive with a 32 bit LONG. */
+#define INDEX_BITS 16
+#define INDEX_MASK ((1UL << INDEX_BITS) - 1)
+#define GENERATION_MASK 0x7FFFUL
+#define make_value(index, generation) \
+    ((LONG) ((((generation) & GENERATION_MASK) << INDEX_BITS) | ((index) + 1)))
+#define value2index(value) ((size_t) (((unsigned long) (value) & INDEX_MASK) - 1))
+#define value2generation(value) \
+    (((unsigned long) (value) >> INDEX_BITS) & GENERATION_MASK)
+
+/* size of the multi-string of all reader names */
+#define READER_LIST_SIZE ((MAX_READERNAME+1)*PCSCLITE_MAX_READERS_CONTEXTS+1)
+/* Memory for SCARD_AUTOALLOCATE is handed out in blocks of a fixed size, which
+ * fits all of our results. Up to POOL_MAX_BLOCKS blocks returned via
+ * SCardFreeMemory are kept for reuse by the context. */
+#define POOL_BLOCK_SIZE READER_LIST_SIZE
+#define POOL_MAX_BLOCKS 8
+
+/* card handle waiting for a transaction, allocated on the waiter's stack */
+struct waiter {
+    SCARDHANDLE hCard;
+    /* set if the card handle has been disconnected while waiting */
+    int gone;
+    struct waiter *next;
+};
+
+/* state of a reader, shared by all handles connected to it */
 struct card {
     DWORD dwShareMode;
     size_t usage_counter;
+    /* card handle holding the transaction or 0 */
+    SCARDHANDLE transaction;
+    /* whether IFDHCreateChannel has been called for the reader */
+    int channel;
+    /* card handles waiting for the transaction in order of arrival */
+    struct waiter *waiters;
+    /* ATR of the inserted card, valid as long as no card has been inserted or
+     * removed (see vicc_monitor_changes) */
+    unsigned char atr[MAX_ATR_SIZE];
+    DWORD atr_len;
+    unsigned long atr_changes;
+    /* SCARD_ATTR_MAXINPUT of the inserted card, valid with the ATR */
+    uint32_t maxinput;
+    /* protects the above */
+    void *lock;
+    /* broadcast with the lock held when the transaction is ended or a waiter
+     * leaves the queue */
+    void *transaction_cond;
+};
+
+/* header of a block, the caller's data follows behind it */
+union block {
+    union block *next;
+    /* keeps the data aligned */
+    long double align;
+};
+
+struct context {
+    int used;
+    unsigned long generation;
+    volatile int cancelled;
+    /* blocks for SCARD_AUTOALLOCATE that may be reused */
+    union block *pool;
+    size_t pool_count;
+};
+
+struct sw_count {
+    unsigned short sw;
+    unsigned long count;
+};
+
+/* APDU statistics of a card handle, only collected with VPCD_STATS */
+struct stats {
+    unsigned long apdus;
+    unsigned long failed;
+    unsigned long long sent;
+    unsigned long long received;
+    unsigned long long latency_us;
+    unsigned long latency[STATS_LATENCY_BUCKETS];
+    struct sw_count sw[STATS_SW_MAX];
+    /* responses with a status word that didn't fit into sw */
+    unsigned long sw_other;
+};
+
+struct handle {
+    int used;
+    unsigned long generation;
+    SCARDCONTEXT hContext;
+    DWORD Lun;
+    /* protocol chosen at SCardConnect or SCardReconnect */
+    DWORD dwProtocol;
+    struct stats stats;
 };
 
 #define SET_R_TEST(value) { r = value; if (r != SCARD_S_SUCCESS) { goto err; } }
 
+/* the tables and context_count are protected by lock_globals() */
 static struct card cards[PCSCLITE_MAX_READERS_CONTEXTS];
-static int cancel_status = 0;
+static struct context contexts[MAX_CONTEXTS];
+static struct handle handles[MAX_HANDLES];
 static size_t context_count = 0;
+/* cached multi-string of all reader names, invalid if reader_list_len is 0 */
+static char reader_list[READER_LIST_SIZE];
+static DWORD reader_list_len = 0;
+/* hostname of libvpcd before initialize_globals() */
+static const char *hostname_old = NULL;
+/* endpoints from VPCD_READERS, NULL selects the configured default */
+static char *endpoints[PCSCLITE_MAX_READERS_CONTEXTS];
+/* number of listed readers */
+static uint32_t reader_count = PCSCLITE_MAX_READERS_CONTEXTS;
+/* destination of the APDU statistics, NULL if they are disabled */
+static FILE *stats_file = NULL;
+static vicc_apdu_hook apdu_hook = NULL;
+static void *apdu_hook_data = NULL;
+/* set if stats_file or apdu_hook is, read by SCardTransmit without
+ * lock_globals() */
+static volatile int tracing = 0;
 
 static const char reader_format_str[] = "Virtual PCD %02"SCNu32;
-static const SCARDHANDLE validhandle = 1;
+static const char openport[] = "/dev/null";
 
 /* defined as "extern" in pcsclite.h, but not used here */
 const SCARD_IO_REQUEST g_rgSCardT0Pci, g_rgSCardT1Pci, g_rgSCardRawPci;
@@ -54,7 +198,67 @@ const SCARD_IO_REQUEST g_rgSCardT0Pci, g_rgSCardT1Pci, g_rgSCardRawPci;
 extern const unsigned char vicc_max_slots;
 extern const char *hostname;
 
-static LONG autoallocate(void *buf, LPDWORD len, DWORD max, void **rbuf)
+/* must be called with lock_globals() held */
+static struct context *get_context(SCARDCONTEXT hContext);
+
+static void *pool_get(SCARDCONTEXT hContext, DWORD size)
+{
+    struct context *context;
+    union block *block = NULL;
+
+    if (size > POOL_BLOCK_SIZE)
+        return NULL;
+
+    lock_globals();
+    context = get_context(hContext);
+    if (context && context->pool) {
+        block = context->pool;
+        context->pool = block->next;
+        context->pool_count--;
+    }
+    unlock_globals();
+
+    if (!block)
+        block = malloc(sizeof *block + POOL_BLOCK_SIZE);
+    if (!block)
+        return NULL;
+
+    return block + 1;
+}
+
+static void pool_put(SCARDCONTEXT hContext, void *mem)
+{
+    struct context *context;
+    union block *block = (union block *) mem - 1;
+
+    lock_globals();
+    context = get_context(hContext);
+    if (context && context->pool_count < POOL_MAX_BLOCKS) {
+        block->next = context->pool;
+        context->pool = block;
+        context->pool_count++;
+        block = NULL;
+    }
+    unlock_globals();
+
+    free(block);
+}
+
+/* must be called with lock_globals() held */
+static void pool_free(struct context *context)
+{
+    union block *block;
+
+    while (context->pool) {
+        block = context->pool;
+        context->pool = block->next;
+        free(block);
+    }
+    context->pool_count = 0;
+}
+
+static LONG autoallocate(SCARDCONTEXT hContext, void *buf, LPDWORD len,
+        DWORD max, void **rbuf)
 {
     LPSTR *p;
 
@@ -62,7 +266,7 @@ static LONG autoallocate(void *buf, LPDWORD len, DWORD max, void **rbuf)
         return SCARD_E_INVALID_PARAMETER;
 
     if (buf && (*len == SCARD_AUTOALLOCATE)) {
-        p = malloc(max);
+        p = pool_get(hContext, max);
         if (!p)
             return SCARD_E_NO_MEMORY;
 
@@ -80,48 +284,389 @@ static LONG autoallocate(void *buf, LPDWORD len, DWORD max, void **rbuf)
     return SCARD_S_SUCCESS;
 }
 
-static void initialize_globals(void)
+/* Returns the memory allocated by autoallocate() to the pool if the function
+ * fails afterwards. Must not be called with a card's lock held. */
+static void autoallocate_undo(SCARDCONTEXT hContext, void *buf, void *rbuf)
+{
+    if (rbuf && rbuf != buf)
+        pool_put(hContext, rbuf);
+}
+
+/* Creates the channel of a reader on first use. Connecting to a remote vicc
+ * may take long, so this is not done for all readers when the first context
+ * is established. */
+static LONG open_channel(struct card *card, DWORD Lun)
+{
+    LONG r = SCARD_E_READER_UNAVAILABLE;
+
+    if (!lock(card->lock))
+        return SCARD_F_INTERNAL_ERROR;
+
+    if (!card->channel && Lun < vicc_max_slots
+            && IFD_SUCCESS == (endpoints[Lun]
+                ? vicc_create_channel (Lun, endpoints[Lun])
+                : IFDHCreateChannel (Lun, VPCDPORT)))
+        card->channel = 1;
+    if (card->channel)
+        r = SCARD_S_SUCCESS;
+
+    unlock(card->lock);
+
+    return r;
+}
+
+/* VPCD_STATS is either "stderr" or the path of a file to append to */
+static void stats_open(void)
+{
+    const char *path = getenv("VPCD_STATS");
+
+    if (!path || !*path)
+        stats_file = NULL;
+    else if (strcmp(path, "stderr") == 0)
+        stats_file = stderr;
+    else
+        stats_file = fopen(path, "a");
+    tracing = stats_file || apdu_hook;
+}
+
+static void stats_close(void)
+{
+    if (stats_file && stats_file != stderr)
+        fclose(stats_file);
+    stats_file = NULL;
+    tracing = apdu_hook != NULL;
+}
+
+/* Parses the comma separated endpoints of VPCD_READERS, e.g.
+ * "host1:35963,unix:/run/vicc2.sock,/dev/null:35964". The n-th endpoint is
+ * used for "Virtual PCD n", an empty one selects the configured default.
+ * Listing more endpoints than there are slots is an error. */
+static LONG parse_readers(void)
+{
+    const char *readers = getenv("VPCD_READERS"), *end;
+    size_t len;
+    LONG r;
+
+    reader_count = PCSCLITE_MAX_READERS_CONTEXTS;
+    if (!readers || !*readers)
+        return SCARD_S_SUCCESS;
+
+    reader_count = 0;
+    while (1) {
+        if (reader_count >= PCSCLITE_MAX_READERS_CONTEXTS
+                || reader_count >= vicc_max_slots) {
+            r = SCARD_E_INVALID_VALUE;
+            goto err;
+        }
+        end = strchr(readers, ',');
+        len = end ? (size_t) (end - readers) : strlen(readers);
+        if (len) {
+            endpoints[reader_count] = malloc(len + 1);
+            if (!endpoints[reader_count]) {
+                r = SCARD_E_NO_MEMORY;
+                goto err;
+            }
+            memcpy(endpoints[reader_count], readers, len);
+            endpoints[reader_count][len] = '\0';
+        }
+        reader_count++;
+        if (!end)
+            break;
+        readers = end + 1;
+    }
+
+    return SCARD_S_SUCCESS;
+
+err:
+    while (reader_count--) {
+        free(endpoints[reader_count]);
+        endpoints[reader_count] = NULL;
+    }
+    reader_count = PCSCLITE_MAX_READERS_CONTEXTS;
+    return r;
+}
+
+/* must be called with lock_globals() held */
+static LONG initialize_globals(void)
 {
     uint32_t index;
-    DWORD Channel = VPCDPORT;
-    const char *hostname_old = hostname;
+    LONG r;
+
+    r = parse_readers();
+    if (r != SCARD_S_SUCCESS)
+        return r;
+
+    for (index = 0; index < PCSCLITE_MAX_READERS_CONTEXTS; index++) {
+        cards[index].lock = create_lock();
+        cards[index].transaction_cond = create_cond();
+        if (!cards[index].lock || !cards[index].transaction_cond) {
+            free_lock(cards[index].lock);
+            free_cond(cards[index].transaction_cond);
+            while (index--) {
+                free_lock(cards[index].lock);
+                free_cond(cards[index].transaction_cond);
+            }
+            memset(cards, 0, sizeof cards);
+            for (index = 0; index < PCSCLITE_MAX_READERS_CONTEXTS; index++) {
+                free(endpoints[index]);
+                endpoints[index] = NULL;
+            }
+            return SCARD_E_NO_MEMORY;
+        }
+    }
+
+    stats_open();
 
+    /* libvpcd reads the hostname when a channel is created */
+    hostname_old = hostname;
     hostname = VPCDHOST;
-    for (index = 0;
-            index < PCSCLITE_MAX_READERS_CONTEXTS && index < vicc_max_slots;
-            index++) {
-        IFDHCreateChannel ((DWORD) index, Channel);
+
+    /* Listening for vicc doesn't block, so we can do it right away.
+     * Otherwise vicc might give up connecting before a reader is used. */
+    for (index = 0; index < reader_count; index++) {
+        if (endpoints[index]
+                ? strncmp(endpoints[index], openport, strlen(openport)) == 0
+                : !hostname)
+            open_channel(&cards[index], (DWORD) index);
     }
-    hostname = hostname_old;
+
+    return SCARD_S_SUCCESS;
 }
 
+/* must be called with lock_globals() held */
 static void release_globals(void)
 {
     uint32_t index;
-    for (index = 0;
-            index < PCSCLITE_MAX_READERS_CONTEXTS && index < vicc_max_slots;
-            index++) {
-        IFDHCloseChannel ((DWORD) index);
+    for (index = 0; index < PCSCLITE_MAX_READERS_CONTEXTS; index++) {
+        /* All card handles have been disconnected, but their waiters may
+         * not have left the queue yet */
+        if (lock(cards[index].lock)) {
+            while (cards[index].waiters
+                    && wait_cond(cards[index].transaction_cond,
+                        cards[index].lock, TRANSACTION_TIMEOUT_MS))
+                ;
+            unlock(cards[index].lock);
+        }
+        if (cards[index].channel)
+            IFDHCloseChannel ((DWORD) index);
+        free_lock(cards[index].lock);
+        free_cond(cards[index].transaction_cond);
+        free(endpoints[index]);
+        endpoints[index] = NULL;
     }
     memset(cards, 0, sizeof cards);
+    reader_list_len = 0;
+    hostname = hostname_old;
+    stats_close();
 }
 
-static LONG handle2card(SCARDHANDLE hCard, struct card **card)
+static unsigned long now_ms(void)
 {
-    uint32_t index = (uint32_t) hCard;
+#ifdef _WIN32
+    return GetTickCount();
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000UL + tv.tv_usec/1000;
+#endif
+}
 
-    if (!card)
+static unsigned long long now_us(void)
+{
+#ifdef _WIN32
+    return GetTickCount()*1000ULL;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000000ULL + tv.tv_usec;
+#endif
+}
+
+/* must be called with lock_globals() held */
+static struct context *get_context(SCARDCONTEXT hContext)
+{
+    size_t index = value2index(hContext);
+
+    if (hContext <= 0 || index >= MAX_CONTEXTS
+            || !contexts[index].used
+            || contexts[index].generation != value2generation(hContext))
+        return NULL;
+
+    return &contexts[index];
+}
+
+static DWORD choose_protocol(DWORD dwPreferredProtocols)
+{
+    /* vpcd doesn't distinguish the protocols, just pick one */
+    if (dwPreferredProtocols & SCARD_PROTOCOL_T1)
+        return SCARD_PROTOCOL_T1;
+    if (dwPreferredProtocols & SCARD_PROTOCOL_T0)
+        return SCARD_PROTOCOL_T0;
+    if (dwPreferredProtocols & SCARD_PROTOCOL_RAW)
+        return SCARD_PROTOCOL_RAW;
+    return SCARD_PROTOCOL_UNDEFINED;
+}
+
+static LONG new_handle(SCARDCONTEXT hContext, DWORD Lun, DWORD dwProtocol,
+        LPSCARDHANDLE phCard)
+{
+    size_t i;
+    LONG r = SCARD_E_NO_MEMORY;
+
+    lock_globals();
+
+    if (!get_context(hContext)) {
+        r = SCARD_E_INVALID_HANDLE;
+        goto err;
+    }
+
+    for (i = 0; i < MAX_HANDLES; i++) {
+        if (!handles[i].used) {
+            handles[i].used = 1;
+            handles[i].hContext = hContext;
+            handles[i].Lun = Lun;
+            handles[i].dwProtocol = dwProtocol;
+            memset(&handles[i].stats, 0, sizeof handles[i].stats);
+            *phCard = (SCARDHANDLE) make_value(i, handles[i].generation);
+            r = SCARD_S_SUCCESS;
+            break;
+        }
+    }
+
+err:
+    unlock_globals();
+
+    return r;
+}
+
+/* must be called with lock_globals() held */
+static struct handle *get_handle(SCARDHANDLE hCard)
+{
+    size_t index = value2index(hCard);
+
+    if (hCard <= 0 || index >= MAX_HANDLES
+            || !handles[index].used
+            || handles[index].generation != value2generation(hCard))
+        return NULL;
+
+    return &handles[index];
+}
+
+static void stats_add(struct stats *stats, DWORD capdu_len,
+        LPCBYTE rapdu, DWORD rapdu_len, unsigned long latency_us)
+{
+    unsigned short sw;
+    size_t i;
+
+    stats->apdus++;
+    stats->sent += capdu_len;
+    stats->latency_us += latency_us;
+    for (i = 0; i < STATS_LATENCY_BUCKETS-1 && latency_us >= 1UL << i; i++)
+        ;
+    stats->latency[i]++;
+
+    if (!rapdu || rapdu_len < 2) {
+        stats->failed++;
+        return;
+    }
+    stats->received += rapdu_len;
+
+    sw = (rapdu[rapdu_len-2] << 8) | rapdu[rapdu_len-1];
+    for (i = 0; i < STATS_SW_MAX; i++) {
+        if (!stats->sw[i].count)
+            stats->sw[i].sw = sw;
+        if (stats->sw[i].sw == sw) {
+            stats->sw[i].count++;
+            return;
+        }
+    }
+    stats->sw_other++;
+}
+
+/* must be called with lock_globals() held */
+static void stats_dump(SCARDHANDLE hCard, const struct handle *handle)
+{
+    const struct stats *stats = &handle->stats;
+    size_t i;
+
+    if (!stats_file || !stats->apdus)
+        return;
+
+    fprintf(stats_file, reader_format_str, (uint32_t) handle->Lun);
+    fprintf(stats_file, ", card handle 0x%lX: %lu APDUs (%lu failed), "
+            "%llu bytes sent, %llu bytes received, %.1f us average\n",
+            (unsigned long) hCard, stats->apdus, stats->failed,
+            stats->sent, stats->received,
+            (double) stats->latency_us / stats->apdus);
+
+    fprintf(stats_file, "  latency:");
+    for (i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        if (!stats->latency[i])
+            continue;
+        if (i < STATS_LATENCY_BUCKETS-1)
+            fprintf(stats_file, " <%luus %lu", 1UL << i, stats->latency[i]);
+        else
+            fprintf(stats_file, " >=%luus %lu", 1UL << (i-1), stats->latency[i]);
+    }
+    fprintf(stats_file, "\n");
+
+    fprintf(stats_file, "  status words:");
+    for (i = 0; i < STATS_SW_MAX && stats->sw[i].count; i++)
+        fprintf(stats_file, " %04X %lu", stats->sw[i].sw, stats->sw[i].count);
+    if (stats->sw_other)
+        fprintf(stats_file, " other %lu", stats->sw_other);
+    fprintf(stats_file, "\n");
+
+    fflush(stats_file);
+}
+
+/* must be called with lock_globals() held */
+static void free_handle(struct handle *handle)
+{
+    handle->used = 0;
+    handle->generation = (handle->generation + 1) & GENERATION_MASK;
+}
+
+static LONG handle2card(SCARDHANDLE hCard, struct card **card, DWORD *Lun)
+{
+    struct handle *handle;
+    LONG r = SCARD_E_INVALID_HANDLE;
+
+    if (!card || !Lun)
         return SCARD_F_INTERNAL_ERROR;
 
-    if (index >= PCSCLITE_MAX_READERS_CONTEXTS)
-        return SCARD_E_INVALID_HANDLE;
+    lock_globals();
+    handle = get_handle(hCard);
+    if (handle) {
+        *Lun = handle->Lun;
+        *card = &cards[handle->Lun];
+        r = SCARD_S_SUCCESS;
+    }
+    unlock_globals();
 
-    *card = &cards[index];
+    return r;
+}
 
-    return SCARD_S_SUCCESS;
+static LONG handle2lun(SCARDHANDLE hCard, DWORD *Lun, DWORD *dwProtocol,
+        SCARDCONTEXT *hContext)
+{
+    struct handle *handle;
+    LONG r = SCARD_E_INVALID_HANDLE;
+
+    lock_globals();
+    handle = get_handle(hCard);
+    if (handle) {
+        *Lun = handle->Lun;
+        *dwProtocol = handle->dwProtocol;
+        *hContext = handle->hContext;
+        r = SCARD_S_SUCCESS;
+    }
+    unlock_globals();
+
+    return r;
 }
 
-LONG handle2reader(DWORD Lun, LPSTR mszReaderName, LPDWORD pcchReaderLen)
+LONG handle2reader(SCARDCONTEXT hContext, DWORD Lun, LPSTR mszReaderName, LPDWORD pcchReaderLen)
 {
     LONG r;
     char *reader;
@@ -132,7 +677,7 @@ LONG handle2reader(DWORD Lun, LPSTR mszReaderName, LPDWORD pcchReaderLen)
         goto err;
     }
 
-    SET_R_TEST( autoallocate(mszReaderName, pcchReaderLen, MAX_READERNAME, (void **) &reader));
+    SET_R_TEST( autoallocate(hContext, mszReaderName, pcchReaderLen, MAX_READERNAME, (void **) &reader));
 
     if (reader) {
         /* caller wants to have the string */
@@ -158,22 +703,21 @@ err:
     return r;
 }
 
-static LONG reader2card(LPCSTR szReader, struct card **card, LPSCARDHANDLE phCard)
+static LONG reader2card(LPCSTR szReader, struct card **card, DWORD *Lun)
 {
     uint32_t index;
 
-    if (!card)
+    if (!card || !Lun)
         return SCARD_F_INTERNAL_ERROR;
 
-    if (1 != sscanf(szReader, reader_format_str, &index)
-            || index >= PCSCLITE_MAX_READERS_CONTEXTS)
+    if (!szReader || 1 != sscanf(szReader, reader_format_str, &index)
+            || index >= reader_count)
         return SCARD_E_READER_UNAVAILABLE;
 
     *card = &cards[index];
-    if (phCard)
-        *phCard = (DWORD) index;
+    *Lun = (DWORD) index;
 
-    return SCARD_S_SUCCESS;
+    return open_channel(*card, *Lun);
 }
 
 static LONG responsecode2long(RESPONSECODE r)
@@ -210,63 +754,287 @@ static LONG responsecode2long(RESPONSECODE r)
     }
 }
 
-static LONG handle2atr(DWORD Lun, LPBYTE pbAtr, LPDWORD pcbAtrLen)
+/* must be called with the card's lock held */
+static LONG update_card(struct card *card, DWORD Lun)
+{
+    LONG r = SCARD_S_SUCCESS;
+    DWORD len = sizeof card->maxinput;
+    unsigned long changes = vicc_monitor_changes();
+
+    if (!card->atr_len || card->atr_changes != changes
+            || vicc_monitor_present(Lun) < 0) {
+        /* without the monitor we don't know if the card has been replaced */
+        card->atr_len = sizeof card->atr;
+        r = responsecode2long(
+                IFDHGetCapabilities (Lun, TAG_IFD_ATR, &card->atr_len,
+                    card->atr));
+        if (r != SCARD_S_SUCCESS) {
+            card->atr_len = 0;
+            goto err;
+        }
+        /* the driver has derived this from the ATR we've just fetched */
+        if (IFD_SUCCESS != IFDHGetCapabilities (Lun, SCARD_ATTR_MAXINPUT,
+                    &len, (PUCHAR) &card->maxinput))
+            card->maxinput = 0;
+        card->atr_changes = changes;
+    }
+
+err:
+    return r;
+}
+
+static LONG card2atr(SCARDCONTEXT hContext, struct card *card, DWORD Lun, LPBYTE pbAtr, LPDWORD pcbAtrLen)
 {
     LONG r;
-    void *atr;
-    unsigned char _atr[MAX_ATR_SIZE];
+    void *atr = NULL;
+    int locked = 0;
 
     SET_R_TEST( responsecode2long(
                 IFDHICCPresence(Lun)));
 
-    SET_R_TEST( autoallocate(pbAtr, pcbAtrLen, MAX_ATR_SIZE, (void **) &atr));
+    /* The pool is protected by lock_globals(), which is taken before a card's
+     * lock, see SCardReleaseContext. So allocate before locking the card. */
+    SET_R_TEST( autoallocate(hContext, pbAtr, pcbAtrLen, MAX_ATR_SIZE, (void **) &atr));
 
-    if (!atr) {
-        /* caller wants to have the length */
-        *pcbAtrLen = sizeof _atr;
-        atr = _atr;
+    if (!lock(card->lock)) {
+        r = SCARD_F_INTERNAL_ERROR;
+        goto err;
     }
+    locked = 1;
 
-    SET_R_TEST( responsecode2long(
-                IFDHGetCapabilities (Lun, TAG_IFD_ATR, pcbAtrLen, atr)));
+    SET_R_TEST( update_card(card, Lun));
+
+    if (atr) {
+        /* caller wants to have the ATR */
+        if (*pcbAtrLen < card->atr_len) {
+            r = SCARD_E_INSUFFICIENT_BUFFER;
+            goto err;
+        }
+        memcpy(atr, card->atr, card->atr_len);
+    }
+    *pcbAtrLen = card->atr_len;
 
 err:
+    if (locked)
+        unlock(card->lock);
+    if (r != SCARD_S_SUCCESS)
+        autoallocate_undo(hContext, pbAtr, atr);
+
+    return r;
+}
+
+/* Waits until all card handles that asked for the transaction before have
+ * ended their transaction, at most TRANSACTION_TIMEOUT_MS. If the card handle
+ * already holds the transaction, *acquired is set to 0 and the transaction is
+ * left untouched. */
+static LONG transaction_acquire(struct card *card, SCARDHANDLE hCard,
+        int *acquired)
+{
+    struct waiter self, **w;
+    unsigned long start = now_ms(), elapsed;
+    LONG r = SCARD_S_SUCCESS;
+
+    if (!lock(card->lock))
+        return SCARD_F_INTERNAL_ERROR;
+
+    if (card->transaction == hCard) {
+        *acquired = 0;
+        goto err;
+    }
+
+    /* queue up */
+    self.hCard = hCard;
+    self.gone = 0;
+    self.next = NULL;
+    for (w = &card->waiters; *w; w = &(*w)->next)
+        ;
+    *w = &self;
+
+    while (card->transaction || card->waiters != &self) {
+        elapsed = now_ms() - start;
+        if (elapsed >= TRANSACTION_TIMEOUT_MS
+                || !wait_cond(card->transaction_cond, card->lock,
+                    TRANSACTION_TIMEOUT_MS - elapsed)) {
+            /* timed out, or without threads nobody else can end the
+             * transaction */
+            r = SCARD_E_SHARING_VIOLATION;
+            break;
+        }
+        if (self.gone) {
+            r = SCARD_E_INVALID_HANDLE;
+            break;
+        }
+    }
+
+    /* leave the queue and let the next waiter check its turn */
+    for (w = &card->waiters; *w != &self; w = &(*w)->next)
+        ;
+    *w = self.next;
+    broadcast_cond(card->transaction_cond);
+
+    if (r == SCARD_S_SUCCESS) {
+        card->transaction = hCard;
+        *acquired = 1;
+    }
+
+err:
+    unlock(card->lock);
+
+    return r;
+}
+
+/* Ends the transaction of a card handle that is being disconnected and makes
+ * its waiters give up. Must be called with the card's lock held. */
+static void transaction_cancel(struct card *card, SCARDHANDLE hCard)
+{
+    struct waiter *w;
+
+    if (card->transaction == hCard)
+        card->transaction = 0;
+    for (w = card->waiters; w; w = w->next) {
+        if (w->hCard == hCard)
+            w->gone = 1;
+    }
+    broadcast_cond(card->transaction_cond);
+}
+
+static LONG transaction_release(struct card *card, SCARDHANDLE hCard)
+{
+    LONG r = SCARD_E_NOT_TRANSACTED;
+
+    if (!lock(card->lock))
+        return SCARD_F_INTERNAL_ERROR;
+
+    if (card->transaction == hCard) {
+        card->transaction = 0;
+        broadcast_cond(card->transaction_cond);
+        r = SCARD_S_SUCCESS;
+    }
+
+    unlock(card->lock);
+
+    return r;
+}
+
+static LONG dispose(struct card *card, DWORD Lun, DWORD dwDisposition)
+{
+    LONG r;
+    UCHAR Atr[MAX_ATR_SIZE];
+    DWORD AtrLength = sizeof Atr;
+
+    switch (dwDisposition) {
+        case SCARD_LEAVE_CARD:
+            r = SCARD_S_SUCCESS;
+            break;
+
+        case SCARD_RESET_CARD:
+            r = responsecode2long(
+                        IFDHPowerICC (Lun, IFD_RESET, Atr, &AtrLength));
+            break;
+
+        case SCARD_EJECT_CARD:
+            /* fall through */
+        case SCARD_UNPOWER_CARD:
+            r = responsecode2long(
+                        IFDHPowerICC (Lun, IFD_POWER_DOWN, Atr, &AtrLength));
+            break;
+
+        default:
+            return SCARD_E_INVALID_PARAMETER;
+    }
+
+    if (dwDisposition != SCARD_LEAVE_CARD && lock(card->lock)) {
+        card->atr_len = 0;
+        unlock(card->lock);
+    }
+
     return r;
 }
 
 PCSC_API LONG SCardEstablishContext(DWORD dwScope, LPCVOID pvReserved1, LPCVOID pvReserved2, LPSCARDCONTEXT phContext)
 {
+    size_t i;
+    LONG r = SCARD_E_NO_MEMORY;
+
     if (!phContext)
         return SCARD_E_INVALID_PARAMETER;
 
+    lock_globals();
+
+    for (i = 0; i < MAX_CONTEXTS; i++) {
+        if (!contexts[i].used)
+            break;
+    }
+    if (i >= MAX_CONTEXTS)
+        goto err;
+
     if (!context_count)
-        initialize_globals();
+        SET_R_TEST( initialize_globals());
     context_count++;
 
-    *phContext = validhandle;
+    contexts[i].used = 1;
+    contexts[i].cancelled = 0;
+    *phContext = make_value(i, contexts[i].generation);
+    r = SCARD_S_SUCCESS;
 
-    return SCARD_S_SUCCESS;
+err:
+    unlock_globals();
+
+    return r;
 }
 
 PCSC_API LONG SCardReleaseContext(SCARDCONTEXT hContext)
 {
-    if (context_count) {
-        context_count--;
+    struct context *context;
+    size_t i;
+    LONG r = SCARD_E_INVALID_HANDLE;
+
+    lock_globals();
+
+    context = get_context(hContext);
+    if (!context)
+        goto err;
+
+    /* disconnect all handles of the context, leaving the card as it is */
+    for (i = 0; i < MAX_HANDLES; i++) {
+        if (handles[i].used && handles[i].hContext == hContext) {
+            if (lock(cards[handles[i].Lun].lock)) {
+                if (cards[handles[i].Lun].usage_counter)
+                    cards[handles[i].Lun].usage_counter--;
+                transaction_cancel(&cards[handles[i].Lun],
+                        make_value(i, handles[i].generation));
+                unlock(cards[handles[i].Lun].lock);
+            }
+            stats_dump(make_value(i, handles[i].generation), &handles[i]);
+            free_handle(&handles[i]);
+        }
     }
 
+    pool_free(context);
+    context->used = 0;
+    context->generation = (context->generation + 1) & GENERATION_MASK;
+    context_count--;
     if (!context_count) {
         release_globals();
     }
+    r = SCARD_S_SUCCESS;
 
-    return SCARD_S_SUCCESS;
+err:
+    unlock_globals();
+
+    return r;
 }
 
 PCSC_API LONG SCardIsValidContext(SCARDCONTEXT hContext)
 {
-    if (context_count && hContext == validhandle)
-        return SCARD_S_SUCCESS;
-    else
-        return SCARD_E_INVALID_HANDLE;
+    LONG r = SCARD_E_INVALID_HANDLE;
+
+    lock_globals();
+    if (get_context(hContext))
+        r = SCARD_S_SUCCESS;
+    unlock_globals();
+
+    return r;
 }
 
 PCSC_API LONG SCardSetTimeout(SCARDCONTEXT hContext, DWORD dwTimeout)
@@ -278,21 +1046,39 @@ PCSC_API LONG SCardSetTimeout(SCARDCONTEXT hContext, DWORD dwTimeout)
 PCSC_API LONG SCardConnect(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareMode, DWORD dwPreferredProtocols, LPSCARDHANDLE phCard, LPDWORD pdwActiveProtocol)
 {
     struct card *card;
+    DWORD Lun, dwProtocol;
     LONG r;
 
-    SET_R_TEST( reader2card(szReader, &card, phCard));
+    if (!phCard)
+        return SCARD_E_INVALID_PARAMETER;
 
-    if (card->usage_counter) {
-        /* card/reader already in use */
-        if (card->dwShareMode == SCARD_SHARE_EXCLUSIVE
-                || card->dwShareMode != dwShareMode) {
-            /* cannot use the provided mode */
-            return SCARD_E_SHARING_VIOLATION;
-        }
+    SET_R_TEST( reader2card(szReader, &card, &Lun));
+
+    if (!lock(card->lock)) {
+        r = SCARD_E_INVALID_HANDLE;
+        goto err;
     }
+    if (card->usage_counter
+            && (card->dwShareMode == SCARD_SHARE_EXCLUSIVE
+                || card->dwShareMode != dwShareMode)) {
+        /* card/reader already in use and cannot use the provided mode */
+        r = SCARD_E_SHARING_VIOLATION;
+    } else {
+        card->usage_counter++;
+        card->dwShareMode = dwShareMode;
+    }
+    unlock(card->lock);
+    if (r != SCARD_S_SUCCESS)
+        goto err;
 
-    card->usage_counter++;
-    card->dwShareMode = dwShareMode;
+    dwProtocol = choose_protocol(dwPreferredProtocols);
+    r = new_handle(hContext, Lun, dwProtocol, phCard);
+    if (r != SCARD_S_SUCCESS && lock(card->lock)) {
+        card->usage_counter--;
+        unlock(card->lock);
+    }
+    if (r == SCARD_S_SUCCESS && pdwActiveProtocol)
+        *pdwActiveProtocol = dwProtocol;
 
 err:
     return r;
@@ -300,19 +1086,39 @@ err:
 
 PCSC_API LONG SCardReconnect(SCARDHANDLE hCard, DWORD dwShareMode, DWORD dwPreferredProtocols, DWORD dwInitialization, LPDWORD pdwActiveProtocol)
 {
+    struct handle *handle;
     struct card *card;
+    DWORD Lun;
     LONG r;
 
-    SET_R_TEST( handle2card(hCard, &card));
+    SET_R_TEST( handle2card(hCard, &card, &Lun));
 
+    if (!lock(card->lock)) {
+        r = SCARD_F_INTERNAL_ERROR;
+        goto err;
+    }
     if (card->usage_counter > 1
             && card->dwShareMode != dwShareMode) {
         /* cannot use the provided mode */
         r = SCARD_E_SHARING_VIOLATION;
-        goto err;
+    } else {
+        card->dwShareMode = dwShareMode;
     }
+    unlock(card->lock);
+    if (r != SCARD_S_SUCCESS)
+        goto err;
 
-    card->dwShareMode = dwShareMode;
+    lock_globals();
+    handle = get_handle(hCard);
+    if (handle) {
+        handle->dwProtocol = choose_protocol(dwPreferredProtocols);
+        if (pdwActiveProtocol)
+            *pdwActiveProtocol = handle->dwProtocol;
+    } else {
+        /* disconnected in the meantime */
+        r = SCARD_E_INVALID_HANDLE;
+    }
+    unlock_globals();
 
 err:
     return r;
@@ -320,50 +1126,49 @@ err:
 
 PCSC_API LONG SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition)
 {
-    DWORD Lun = hCard;
+    DWORD Lun;
     LONG r;
-    UCHAR Atr[MAX_ATR_SIZE];
-    DWORD AtrLength = sizeof Atr;
     struct card *card;
+    struct handle *handle;
+    size_t usage_counter = 0;
 
-    SET_R_TEST( handle2card(hCard, &card));
+    if (dwDisposition != SCARD_LEAVE_CARD
+            && dwDisposition != SCARD_RESET_CARD
+            && dwDisposition != SCARD_UNPOWER_CARD
+            && dwDisposition != SCARD_EJECT_CARD) {
+        r = SCARD_E_INVALID_PARAMETER;
+        goto err;
+    }
 
-    if (!card->usage_counter) {
+    lock_globals();
+    handle = get_handle(hCard);
+    if (handle) {
+        Lun = handle->Lun;
+        stats_dump(hCard, handle);
+        free_handle(handle);
+    }
+    unlock_globals();
+    if (!handle) {
         r = SCARD_E_INVALID_HANDLE;
         goto err;
     }
-    card->usage_counter--;
-
-    switch (dwDisposition) {
-        case SCARD_LEAVE_CARD:
-            r = SCARD_S_SUCCESS;
-            break;
-
-        case SCARD_RESET_CARD:
-            if (card->usage_counter) {
-                r = SCARD_E_CANT_DISPOSE;
-                goto err;
-            }
-            SET_R_TEST( responsecode2long(
-                        IFDHPowerICC (Lun, IFD_RESET, Atr, &AtrLength)));
-            break;
-
-        case SCARD_EJECT_CARD:
-            /* fall through */
-        case SCARD_UNPOWER_CARD:
-            if (card->usage_counter) {
-                r = SCARD_E_CANT_DISPOSE;
-                goto err;
-            }
-            SET_R_TEST( responsecode2long(
-                        IFDHPowerICC (Lun, IFD_POWER_DOWN, Atr, &AtrLength)));
-            break;
+    card = &cards[Lun];
+
+    if (lock(card->lock)) {
+        if (card->usage_counter)
+            card->usage_counter--;
+        usage_counter = card->usage_counter;
+        transaction_cancel(card, hCard);
+        unlock(card->lock);
+    }
 
-        default:
-            r = SCARD_E_INVALID_PARAMETER;
-            break;
+    if (dwDisposition != SCARD_LEAVE_CARD && usage_counter) {
+        r = SCARD_E_CANT_DISPOSE;
+        goto err;
     }
 
+    r = dispose(card, Lun, dwDisposition);
+
 err:
     return r;
 }
@@ -371,15 +1176,12 @@ err:
 PCSC_API LONG SCardBeginTransaction(SCARDHANDLE hCard)
 {
     struct card *card;
+    DWORD Lun;
     LONG r;
+    int acquired;
 
-    SET_R_TEST( handle2card(hCard, &card));
-
-    /* we don't have a strategy if an other card handle is active */
-    if (card->usage_counter != 1)
-        return SCARD_E_SHARING_VIOLATION;
-
-    card->dwShareMode = SCARD_SHARE_EXCLUSIVE;
+    SET_R_TEST( handle2card(hCard, &card, &Lun));
+    SET_R_TEST( transaction_acquire(card, hCard, &acquired));
 
 err:
     return r;
@@ -388,11 +1190,27 @@ err:
 PCSC_API LONG SCardEndTransaction(SCARDHANDLE hCard, DWORD dwDisposition)
 {
     struct card *card;
+    DWORD Lun;
     LONG r;
 
-    SET_R_TEST( handle2card(hCard, &card));
+    SET_R_TEST( handle2card(hCard, &card, &Lun));
+
+    if (!lock(card->lock)) {
+        r = SCARD_F_INTERNAL_ERROR;
+        goto err;
+    }
+    if (card->transaction != hCard)
+        r = SCARD_E_NOT_TRANSACTED;
+    unlock(card->lock);
+    if (r != SCARD_S_SUCCESS)
+        goto err;
 
-    card->dwShareMode = dwDisposition;
+    /* the card is still locked while it is reset or powered down */
+    r = dispose(card, Lun, dwDisposition);
+    if (r == SCARD_E_INVALID_PARAMETER)
+        goto err;
+
+    transaction_release(card, hCard);
 
 err:
     return r;
@@ -405,87 +1223,145 @@ PCSC_API LONG SCardCancelTransaction(SCARDHANDLE hCard)
 
 PCSC_API LONG SCardStatus(SCARDHANDLE hCard, LPSTR mszReaderName, LPDWORD pcchReaderLen, LPDWORD pdwState, LPDWORD pdwProtocol, LPBYTE pbAtr, LPDWORD pcbAtrLen)
 {
+    SCARDCONTEXT hContext;
+    DWORD Lun, dwProtocol;
     LONG r;
+    int reader_allocated = mszReaderName && pcchReaderLen
+        && *pcchReaderLen == SCARD_AUTOALLOCATE;
+
+    SET_R_TEST( handle2lun(hCard, &Lun, &dwProtocol, &hContext));
+    SET_R_TEST( handle2reader(hContext, Lun, mszReaderName, pcchReaderLen));
+    r = card2atr(hContext, &cards[Lun], Lun, pbAtr, pcbAtrLen);
+    if (r != SCARD_S_SUCCESS) {
+        if (reader_allocated)
+            pool_put(hContext, *(LPSTR *) mszReaderName);
+        goto err;
+    }
 
-    SET_R_TEST( handle2reader(hCard, mszReaderName, pcchReaderLen));
-    SET_R_TEST( handle2atr(hCard, pbAtr, pcbAtrLen));
+    if (pdwState)
+        *pdwState = SCARD_PRESENT|SCARD_POWERED|SCARD_SPECIFIC;
+    if (pdwProtocol)
+        *pdwProtocol = dwProtocol;
 
 err:
     return r;
 }
 
-PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCARD_READERSTATE rgReaderStates, DWORD cReaders)
+static size_t update_states(SCARDCONTEXT hContext, LPSCARD_READERSTATE rgReaderStates, DWORD cReaders)
 {
-    SCARDHANDLE hCard;
-    size_t i, seconds, event_count = 0;
+    DWORD Lun, count;
+    size_t i, event_count = 0;
     struct card *card;
 
-    cancel_status = 0;
-
-    if (dwTimeout == INFINITE) {
-        /* "infinite" timeout */
-        seconds = 60;
-    } else {
-        seconds = dwTimeout/1000;
-    }
-
-    do {
-        for (i = 0; i < cReaders; i++) {
-            if (rgReaderStates[i].dwCurrentState & SCARD_STATE_IGNORE)
-                /* this reader should be ignored */
-                continue;
-
-            if (strcmp(rgReaderStates[i].szReader, "\\\\?PnP?\\Notification") == 0)
-                /* we don't allow readers to be added or removed */
-                continue;
-
-            rgReaderStates[i].dwEventState = 0;
-
-            if (SCARD_S_SUCCESS != reader2card(rgReaderStates[i].szReader,
-                        &card, &hCard)) {
-                /* given reader not recognized */
-                rgReaderStates[i].dwEventState |= SCARD_STATE_UNKNOWN
-                    | SCARD_STATE_CHANGED |SCARD_STATE_IGNORE;
+    for (i = 0; i < cReaders; i++) {
+        if (rgReaderStates[i].dwCurrentState & SCARD_STATE_IGNORE)
+            /* this reader should be ignored */
+            continue;
+
+        if (strcmp(rgReaderStates[i].szReader, "\\\\?PnP?\\Notification") == 0) {
+            /* like PCSC-Lite, report the number of readers in the upper
+             * word and signal a change if the caller saw a different one.
+             * The set of readers is static, a connecting vicc only inserts
+             * a card, so this never changes while the caller waits. */
+            count = reader_count;
+            rgReaderStates[i].dwEventState = count << 16;
+            if ((rgReaderStates[i].dwCurrentState >> 16) != count) {
+                rgReaderStates[i].dwEventState |= SCARD_STATE_CHANGED;
                 event_count++;
-                continue;
             }
+            continue;
+        }
+
+        rgReaderStates[i].dwEventState = 0;
+
+        if (SCARD_S_SUCCESS != reader2card(rgReaderStates[i].szReader,
+                    &card, &Lun)) {
+            /* given reader not recognized */
+            rgReaderStates[i].dwEventState |= SCARD_STATE_UNKNOWN
+                | SCARD_STATE_CHANGED |SCARD_STATE_IGNORE;
+            event_count++;
+            continue;
+        }
 
+        if (lock(card->lock)) {
             if (card->usage_counter) {
                 rgReaderStates[i].dwEventState |= SCARD_STATE_INUSE;
                 if (card->dwShareMode == SCARD_SHARE_EXCLUSIVE)
                     rgReaderStates[i].dwEventState |= SCARD_STATE_EXCLUSIVE;
             }
+            unlock(card->lock);
+        }
 
-            /* normally the application should set cbAtr appropriately.
-             * Some application don't mind to do that (e.g., pcsc_scan) */
-            rgReaderStates[i].cbAtr = sizeof rgReaderStates[i].rgbAtr;
+        /* normally the application should set cbAtr appropriately.
+         * Some application don't mind to do that (e.g., pcsc_scan) */
+        rgReaderStates[i].cbAtr = sizeof rgReaderStates[i].rgbAtr;
 
-            if (SCARD_S_SUCCESS != handle2atr(hCard, rgReaderStates[i].rgbAtr,
-                        &rgReaderStates[i].cbAtr)) {
-                rgReaderStates[i].dwEventState |= SCARD_STATE_EMPTY;
-                rgReaderStates[i].cbAtr = 0;
-            } else {
-                rgReaderStates[i].dwEventState |= SCARD_STATE_PRESENT;
-            }
+        if (SCARD_S_SUCCESS != card2atr(hContext, card, Lun, rgReaderStates[i].rgbAtr,
+                    &rgReaderStates[i].cbAtr)) {
+            rgReaderStates[i].dwEventState |= SCARD_STATE_EMPTY;
+            rgReaderStates[i].cbAtr = 0;
+        } else {
+            rgReaderStates[i].dwEventState |= SCARD_STATE_PRESENT;
+        }
 
-            /* if current and event state differ in the flags SCARD_STATE_EMPTY
-             * or SCARD_STATE_PRESENT a state change has occurred */
-            if (((rgReaderStates[i].dwCurrentState & SCARD_STATE_EMPTY)
-                        != (rgReaderStates[i].dwEventState & SCARD_STATE_EMPTY))
-                    || ((rgReaderStates[i].dwCurrentState & SCARD_STATE_PRESENT)
-                        != (rgReaderStates[i].dwEventState & SCARD_STATE_PRESENT))) {
-                rgReaderStates[i].dwEventState |= SCARD_STATE_CHANGED;
-                event_count++;
-            }
+        /* if current and event state differ in the flags SCARD_STATE_EMPTY
+         * or SCARD_STATE_PRESENT a state change has occurred */
+        if (((rgReaderStates[i].dwCurrentState & SCARD_STATE_EMPTY)
+                    != (rgReaderStates[i].dwEventState & SCARD_STATE_EMPTY))
+                || ((rgReaderStates[i].dwCurrentState & SCARD_STATE_PRESENT)
+                    != (rgReaderStates[i].dwEventState & SCARD_STATE_PRESENT))) {
+            rgReaderStates[i].dwEventState |= SCARD_STATE_CHANGED;
+            event_count++;
         }
+    }
+
+    return event_count;
+}
+
+PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCARD_READERSTATE rgReaderStates, DWORD cReaders)
+{
+    struct context *context;
+    size_t event_count = 0;
+    unsigned long start, elapsed, changes;
+    int timeout;
+
+    lock_globals();
+    context = get_context(hContext);
+    if (context)
+        context->cancelled = 0;
+    unlock_globals();
+    if (!context)
+        return SCARD_E_INVALID_HANDLE;
+
+    start = now_ms();
 
-        if (!seconds || event_count)
+    while (1) {
+        /* remember the state we're looking at, so that we don't miss an
+         * event while checking the readers */
+        changes = vicc_monitor_changes();
+
+        event_count = update_states(hContext, rgReaderStates, cReaders);
+        if (event_count || context->cancelled)
             break;
 
-        sleep(1);
-        seconds--;
+        if (dwTimeout == INFINITE) {
+            timeout = -1;
+        } else {
+            elapsed = now_ms() - start;
+            if (elapsed >= dwTimeout)
+                break;
+            timeout = (int) (dwTimeout - elapsed);
+        }
 
-    } while (!cancel_status);
+        if (vicc_monitor_wait_changes(changes, timeout) < 0) {
+            /* slots are not monitored, poll them */
+            msleep(timeout < 0 || timeout > STATUS_POLL_MS ?
+                    STATUS_POLL_MS : timeout);
+        }
+    }
+
+    if (!event_count && context->cancelled)
+        return SCARD_E_CANCELLED;
 
     if (!event_count)
         return SCARD_E_TIMEOUT;
@@ -493,91 +1369,276 @@ PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCA
     return SCARD_S_SUCCESS;
 }
 
-PCSC_API LONG SCardCancel(SCARDHANDLE hCard)
+PCSC_API LONG SCardCancel(SCARDCONTEXT hContext)
 {
-    cancel_status = 1;
+    struct context *context;
+
+    lock_globals();
+    context = get_context(hContext);
+    if (context)
+        context->cancelled = 1;
+    unlock_globals();
+    if (!context)
+        return SCARD_E_INVALID_HANDLE;
+
+    vicc_monitor_cancel_all();
+
     return SCARD_S_SUCCESS;
 }
 
 PCSC_API LONG SCardControl(SCARDHANDLE hCard, DWORD dwControlCode, LPCVOID pbSendBuffer, DWORD cbSendLength, LPVOID pbRecvBuffer, DWORD cbRecvLength, LPDWORD lpBytesReturned)
 {
-    return responsecode2long(
-            IFDHControl (hCard, dwControlCode, (PUCHAR) pbSendBuffer,
+    struct card *card;
+    DWORD Lun;
+    LONG r;
+
+    int acquired;
+
+    SET_R_TEST( handle2card(hCard, &card, &Lun));
+    SET_R_TEST( transaction_acquire(card, hCard, &acquired));
+
+    r = responsecode2long(
+            IFDHControl (Lun, dwControlCode, (PUCHAR) pbSendBuffer,
                 cbSendLength, pbRecvBuffer, cbRecvLength, lpBytesReturned));
+
+    if (acquired)
+        transaction_release(card, hCard);
+
+err:
+    return r;
+}
+
+/* Collects the statistics of the card handle and calls the hook */
+static void trace_apdu(SCARDHANDLE hCard, LPCBYTE capdu, DWORD capdu_len,
+        LPCBYTE rapdu, DWORD rapdu_len, LONG result,
+        unsigned long latency_us)
+{
+    struct handle *handle;
+    vicc_apdu_hook hook;
+    void *data;
+
+    if (result != SCARD_S_SUCCESS) {
+        rapdu = NULL;
+        rapdu_len = 0;
+    }
+
+    lock_globals();
+    if (stats_file) {
+        handle = get_handle(hCard);
+        if (handle)
+            stats_add(&handle->stats, capdu_len, rapdu, rapdu_len,
+                    latency_us);
+    }
+    hook = apdu_hook;
+    data = apdu_hook_data;
+    unlock_globals();
+
+    if (hook)
+        hook(hCard, capdu, capdu_len, rapdu, rapdu_len, result, latency_us,
+                data);
+}
+
+PCSC_API void vicc_set_apdu_hook(vicc_apdu_hook hook, void *data)
+{
+    lock_globals();
+    apdu_hook = hook;
+    apdu_hook_data = data;
+    tracing = stats_file || apdu_hook;
+    unlock_globals();
 }
 
 PCSC_API LONG SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength, LPSCARD_IO_REQUEST pioRecvPci, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
 {
-    DWORD Lun = hCard;
+    struct card *card;
+    DWORD Lun;
     LONG r;
     /* ignored */
     SCARD_IO_HEADER SendPci, RecvPci;
+    int acquired;
+    int traced = tracing;
+    unsigned long long start = traced ? now_us() : 0;
+
+    SET_R_TEST( handle2card(hCard, &card, &Lun));
+    /* wait for an other card handle's transaction to end */
+    SET_R_TEST( transaction_acquire(card, hCard, &acquired));
 
     /* transceive data */
-    SET_R_TEST( responsecode2long(
+    r = responsecode2long(
                 IFDHTransmitToICC (Lun, SendPci, (PUCHAR) pbSendBuffer,
-                    cbSendLength, pbRecvBuffer, pcbRecvLength, &RecvPci)));
+                    cbSendLength, pbRecvBuffer, pcbRecvLength, &RecvPci));
+
+    if (acquired)
+        transaction_release(card, hCard);
+
+    if (traced)
+        trace_apdu(hCard, pbSendBuffer, cbSendLength, pbRecvBuffer,
+                pcbRecvLength ? *pcbRecvLength : 0, r,
+                (unsigned long) (now_us() - start));
 
 err:
     return r;
 }
 
-PCSC_API LONG SCardGetAttrib(SCARDHANDLE hCard, DWORD dwAttrId, LPBYTE pbAttr, LPDWORD pcbAttrLen)
+static LONG attr_copy(SCARDCONTEXT hContext, const void *value, DWORD len, LPBYTE pbAttr, LPDWORD pcbAttrLen)
 {
-    return SCARD_F_INTERNAL_ERROR;
+    LONG r;
+    void *attr = NULL;
+
+    SET_R_TEST( autoallocate(hContext, pbAttr, pcbAttrLen, len, &attr));
+
+    if (attr) {
+        /* caller wants to have the attribute */
+        if (*pcbAttrLen < len) {
+            r = SCARD_E_INSUFFICIENT_BUFFER;
+            goto err;
+        }
+        memcpy(attr, value, len);
+    }
+    *pcbAttrLen = len;
+
+err:
+    if (r != SCARD_S_SUCCESS)
+        autoallocate_undo(hContext, pbAttr, attr);
+
+    return r;
 }
 
-PCSC_API LONG SCardSetAttrib(SCARDHANDLE hCard, DWORD dwAttrId, LPCBYTE pbAttr, DWORD cbAttrLen)
+/* all attributes are answered from the reader's cache without asking vicc */
+PCSC_API LONG SCardGetAttrib(SCARDHANDLE hCard, DWORD dwAttrId, LPBYTE pbAttr, LPDWORD pcbAttrLen)
 {
-    return SCARD_F_INTERNAL_ERROR;
+    SCARDCONTEXT hContext;
+    DWORD Lun, dwProtocol, len;
+    LONG r;
+    uint32_t maxinput;
+    char name[MAX_READERNAME];
+    unsigned char presence;
+
+    SET_R_TEST( handle2lun(hCard, &Lun, &dwProtocol, &hContext));
+
+    switch (dwAttrId) {
+        case SCARD_ATTR_ATR_STRING:
+            r = card2atr(hContext, &cards[Lun], Lun, pbAttr, pcbAttrLen);
+            break;
+
+        case SCARD_ATTR_MAXINPUT:
+            /* make sure the cache is up to date */
+            SET_R_TEST( card2atr(hContext, &cards[Lun], Lun, NULL, &len));
+            if (!lock(cards[Lun].lock)) {
+                r = SCARD_F_INTERNAL_ERROR;
+                goto err;
+            }
+            maxinput = cards[Lun].maxinput;
+            unlock(cards[Lun].lock);
+            if (!maxinput) {
+                r = SCARD_E_UNSUPPORTED_FEATURE;
+                goto err;
+            }
+            r = attr_copy(hContext, &maxinput, sizeof maxinput, pbAttr, pcbAttrLen);
+            break;
+
+        case SCARD_ATTR_ICC_PRESENCE:
+            /* 0 = not present, 2 = present and swallowed */
+            presence = IFDHICCPresence(Lun) == IFD_ICC_PRESENT ? 2 : 0;
+            r = attr_copy(hContext, &presence, sizeof presence, pbAttr, pcbAttrLen);
+            break;
+
+        case SCARD_ATTR_CURRENT_PROTOCOL_TYPE:
+            r = attr_copy(hContext, &dwProtocol, sizeof dwProtocol, pbAttr, pcbAttrLen);
+            break;
+
+        case SCARD_ATTR_VENDOR_NAME:
+            r = attr_copy(hContext, PACKAGE_NAME, sizeof PACKAGE_NAME, pbAttr, pcbAttrLen);
+            break;
+
+        case SCARD_ATTR_DEVICE_FRIENDLY_NAME_A:
+        case SCARD_ATTR_DEVICE_SYSTEM_NAME_A:
+            len = sizeof name;
+            SET_R_TEST( handle2reader(hContext, Lun, name, &len));
+            /* include the null character */
+            r = attr_copy(hContext, name, len + 1, pbAttr, pcbAttrLen);
+            break;
+
+        default:
+            r = SCARD_E_UNSUPPORTED_FEATURE;
+            break;
+    }
+
+err:
+    return r;
 }
 
-PCSC_API LONG SCardListReaders(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR mszReaders, LPDWORD pcchReaders)
+PCSC_API LONG SCardSetAttrib(SCARDHANDLE hCard, DWORD dwAttrId, LPCBYTE pbAttr, DWORD cbAttrLen)
 {
-    uint32_t index;
-    DWORD readerslen = 0, readerlen;
+    SCARDCONTEXT hContext;
+    DWORD Lun, dwProtocol;
     LONG r;
-    char *readers = NULL;
 
-    if (!pcchReaders) {
-        r = SCARD_E_INVALID_PARAMETER;
-        goto err;
-    }
+    SET_R_TEST( handle2lun(hCard, &Lun, &dwProtocol, &hContext));
 
+    r = responsecode2long(
+            IFDHSetCapabilities (Lun, dwAttrId, cbAttrLen, (PUCHAR) pbAttr));
 
-    SET_R_TEST( autoallocate(mszReaders, pcchReaders,
-                (MAX_READERNAME+1)*PCSCLITE_MAX_READERS_CONTEXTS+1,
-                (void **) &readers));
+err:
+    return r;
+}
 
+/* must be called with lock_globals() held */
+static void build_reader_list(void)
+{
+    uint32_t index;
+    DWORD readerlen;
 
-    /* write reader names */
-    for (index = 0; index < PCSCLITE_MAX_READERS_CONTEXTS; index++) {
+    reader_list_len = 0;
+    for (index = 0; index < reader_count; index++) {
         /* what memory we have left */
-        readerlen = *pcchReaders - readerslen;
+        readerlen = sizeof reader_list - reader_list_len;
 
         /* get the current readername */
-        SET_R_TEST( handle2reader(index, readers ? readers+readerslen : NULL,
-                    &readerlen));
+        if (SCARD_S_SUCCESS != handle2reader(0, index,
+                    reader_list + reader_list_len, &readerlen)) {
+            reader_list_len = 0;
+            return;
+        }
 
-        /* readerlen has been set to the correct value */
-        readerslen += readerlen;
-        /* copy null character */
-        readerslen++;
+        /* readerlen has been set to the correct value, copy null character */
+        reader_list_len += readerlen + 1;
     }
 
     /* write a null character as final delimiter */
-    if (readers) {
-        readers[readerslen] = '\0';
+    reader_list[reader_list_len] = '\0';
+    reader_list_len++;
+}
+
+PCSC_API LONG SCardListReaders(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR mszReaders, LPDWORD pcchReaders)
+{
+    LONG r;
+    char *readers = NULL;
+
+    if (!pcchReaders) {
+        r = SCARD_E_INVALID_PARAMETER;
+        goto err;
     }
-    readerslen++;
 
-    *pcchReaders = readerslen;
+    SET_R_TEST( autoallocate(hContext, mszReaders, pcchReaders,
+                READER_LIST_SIZE, (void **) &readers));
 
-    if (!readerslen) {
+    lock_globals();
+    if (!reader_list_len)
+        build_reader_list();
+
+    if (!reader_list_len) {
         r = SCARD_E_NO_READERS_AVAILABLE;
+    } else if (readers && *pcchReaders < reader_list_len) {
+        r = SCARD_E_INSUFFICIENT_BUFFER;
     } else {
-        r = SCARD_S_SUCCESS;
+        if (readers)
+            memcpy(readers, reader_list, reader_list_len);
+        *pcchReaders = reader_list_len;
     }
+    unlock_globals();
+
+    if (r != SCARD_S_SUCCESS)
+        autoallocate_undo(hContext, mszReaders, readers);
 
 err:
     return r;
@@ -588,7 +1649,7 @@ PCSC_API LONG SCardListReaderGroups(SCARDCONTEXT hContext, LPSTR mszGroups, LPDW
     LONG r;
     unsigned char *groups;
 
-    SET_R_TEST( autoallocate(mszGroups, pcchGroups, 1, (void **) &groups));
+    SET_R_TEST( autoallocate(hContext, mszGroups, pcchGroups, 1, (void **) &groups));
 
     if (groups) {
         /* caller wants to have the string */
@@ -606,7 +1667,8 @@ err:
 
 PCSC_API LONG SCardFreeMemory(SCARDCONTEXT hContext, LPCVOID pvMem)
 {
-    free((void *) pvMem);
+    if (pvMem)
+        pool_put(hContext, (void *) pvMem);
 
     return SCARD_S_SUCCESS;
 }
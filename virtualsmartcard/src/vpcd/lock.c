@@ -17,6 +17,10 @@
  * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 
 #ifdef _WIN32
@@ -48,14 +52,40 @@ void free_lock(void *io_lock)
     free(io_lock);
 }
 
+void *create_cond(void)
+{
+    CONDITION_VARIABLE *cond = malloc(sizeof *cond);
+    if (cond)
+        InitializeConditionVariable(cond);
+    return cond;
+}
+
+int wait_cond(void *cond, void *io_lock, unsigned long timeout_ms)
+{
+    return SleepConditionVariableCS(cond, io_lock, timeout_ms) ? 1 : 0;
+}
+
+int broadcast_cond(void *cond)
+{
+    WakeAllConditionVariable(cond);
+    return 1;
+}
+
+void free_cond(void *cond)
+{
+    free(cond);
+}
+
 #else
 
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
 
 int lock(void *io_lock)
 {
-    r = 0;
+    int r = 0;
     if (0 == pthread_mutex_lock(io_lock))
         r = 1;
     return r;
@@ -63,7 +93,7 @@ int lock(void *io_lock)
 
 int unlock(void *io_lock)
 {
-    r = 0;
+    int r = 0;
     if (0 == pthread_mutex_unlock(io_lock))
         r = 1;
     return r;
@@ -72,16 +102,64 @@ int unlock(void *io_lock)
 void *create_lock(void)
 {
     pthread_mutex_t *io_lock = malloc(sizeof *io_lock);
-    if (io_lock) {
-        *io_lock = PTHREAD_MUTEX_INITIALIZER;
+    if (io_lock && 0 != pthread_mutex_init(io_lock, NULL)) {
+        free(io_lock);
+        io_lock = NULL;
     }
     return io_lock;
 }
 
 void free_lock(void *io_lock)
 {
-    pthread_mutex_destroy(io_lock);
-    free(io_lock);
+    if (io_lock) {
+        pthread_mutex_destroy(io_lock);
+        free(io_lock);
+    }
+}
+
+void *create_cond(void)
+{
+    pthread_cond_t *cond = malloc(sizeof *cond);
+    if (cond && 0 != pthread_cond_init(cond, NULL)) {
+        free(cond);
+        cond = NULL;
+    }
+    return cond;
+}
+
+int wait_cond(void *cond, void *io_lock, unsigned long timeout_ms)
+{
+    struct timeval now;
+    struct timespec deadline;
+    int r = 0;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout_ms/1000;
+    deadline.tv_nsec = now.tv_usec*1000 + (timeout_ms%1000)*1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    if (0 == pthread_cond_timedwait(cond, io_lock, &deadline))
+        r = 1;
+    return r;
+}
+
+int broadcast_cond(void *cond)
+{
+    int r = 0;
+    if (0 == pthread_cond_broadcast(cond))
+        r = 1;
+    return r;
+}
+
+void free_cond(void *cond)
+{
+    if (cond) {
+        pthread_cond_destroy(cond);
+        free(cond);
+    }
 }
 
 #else
@@ -105,6 +183,25 @@ void free_lock(void *io_lock)
 {
 }
 
+void *create_cond(void)
+{
+    return (void *) 1;
+}
+
+int wait_cond(void *cond, void *io_lock, unsigned long timeout_ms)
+{
+    return 0;
+}
+
+int broadcast_cond(void *cond)
+{
+    return 1;
+}
+
+void free_cond(void *cond)
+{
+}
+
 #endif
 
 #endif
@@ -27,6 +27,13 @@ int lock(void *io_lock);
 int unlock(void *io_lock);
 void *create_lock(void);
 void free_lock(void *io_lock);
+/* Condition variables to be used with a lock of create_lock(). wait_cond()
+ * returns 0 if timeout_ms have passed or on error. Without threads, it fails
+ * right away because nobody could signal the condition. */
+void *create_cond(void);
+int wait_cond(void *cond, void *io_lock, unsigned long timeout_ms);
+int broadcast_cond(void *cond);
+void free_cond(void *cond);
 #ifdef  __cplusplus
 }
 #endif
@@ -38,11 +38,16 @@ typedef WORD uint16_t;
 #else
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
 #define INVALID_SOCKET -1
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
 #endif
 
 #include <errno.h>
@@ -53,9 +58,14 @@ typedef WORD uint16_t;
 
 static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t size, const unsigned char *buffer);
 static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer);
+static ssize_t recvFromVICCInto(struct vicc_ctx *ctx, size_t length, unsigned char *buffer);
+
+/* messages up to this size are sent together with their length in one go */
+#define VPCD_SEND_BUFFER 512
 
 static ssize_t sendall(SOCKET sock, const void *buffer, size_t size);
 static ssize_t recvall(SOCKET sock, void *buffer, size_t size);
+static ssize_t recvavail(SOCKET sock, void *buffer, size_t size);
 
 static SOCKET opensock(unsigned short port);
 static SOCKET connectsock(const char *hostname, unsigned short port);
@@ -89,6 +99,61 @@ ssize_t recvall(SOCKET sock, void *buffer, size_t size) {
             size, MSG_WAITALL|MSG_NOSIGNAL);
 }
 
+/* Receives what is available without blocking. Returns the number of bytes
+ * received, 0 if no data is available or -1 if the connection is closed. */
+static ssize_t recvavail(SOCKET sock, void *buffer, size_t size)
+{
+    fd_set rfds;
+    struct timeval tv;
+    ssize_t r;
+
+    if (sock == INVALID_SOCKET)
+        return -1;
+
+    FD_ZERO(&rfds);
+#if _WIN32
+    /* work around clumsy define of FD_SET in winsock2.h */
+#pragma warning(disable:4127)
+    FD_SET(sock, &rfds);
+#pragma warning(default:4127)
+#else
+    FD_SET(sock, &rfds);
+#endif
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+
+    if (select((int) sock+1, &rfds, NULL, NULL, &tv) == -1)
+        return errno == EINTR ? 0 : -1;
+
+    if (!FD_ISSET(sock, &rfds))
+        return 0;
+
+    /* readable, so recv() doesn't block */
+    r = recv(sock, buffer,
+#ifdef _WIN32
+            (int)
+#endif
+            size, MSG_NOSIGNAL);
+
+    return r > 0 ? r : -1;
+}
+
+static SOCKET nodelay(SOCKET sock)
+{
+#ifdef _WIN32
+    BOOL yes = TRUE;
+#else
+    int yes = 1;
+#endif
+
+    /* APDUs are small and latency bound, don't wait for more data */
+    if (sock != INVALID_SOCKET)
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *) &yes, sizeof yes);
+
+    return sock;
+}
+
 static SOCKET opensock(unsigned short port)
 {
     SOCKET sock;
@@ -131,12 +196,45 @@ err:
     return INVALID_SOCKET;
 }
 
+#ifdef HAVE_SYS_UN_H
+static SOCKET connectunix(const char *path)
+{
+    struct sockaddr_un addr;
+    SOCKET sock;
+
+    if (strlen(path) >= sizeof addr.sun_path)
+        return INVALID_SOCKET;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    if (connect(sock, (struct sockaddr *) &addr, sizeof addr) != 0) {
+        close(sock);
+        return INVALID_SOCKET;
+    }
+
+    return sock;
+}
+#endif
+
 static SOCKET connectsock(const char *hostname, unsigned short port)
 {
 	struct addrinfo hints, *res = NULL, *cur;
 	SOCKET sock = INVALID_SOCKET;
     char _port[10];
 
+    if (strncmp(hostname, VPCD_UNIX_PREFIX, strlen(VPCD_UNIX_PREFIX)) == 0)
+#ifdef HAVE_SYS_UN_H
+        return connectunix(hostname + strlen(VPCD_UNIX_PREFIX));
+#else
+        return INVALID_SOCKET;
+#endif
+
     if (snprintf(_port, sizeof _port, "%hu", port) < 0)
         goto err;
     _port[(sizeof _port) -1] = '\0';
@@ -162,11 +260,12 @@ static SOCKET connectsock(const char *hostname, unsigned short port)
 			break;
 
 		close(sock);
+		sock = INVALID_SOCKET;
 	}
 
 err:
 	freeaddrinfo(res);
-	return sock;
+	return nodelay(sock);
 }
 
 SOCKET waitforclient(SOCKET server, long secs, long usecs)
@@ -193,8 +292,8 @@ SOCKET waitforclient(SOCKET server, long secs, long usecs)
         return INVALID_SOCKET;
 
     if (FD_ISSET(server, &rfds))
-        return accept(server, (struct sockaddr *) &client_sockaddr,
-                &client_socklen);
+        return nodelay(accept(server, (struct sockaddr *) &client_sockaddr,
+                &client_socklen));
 
     return INVALID_SOCKET;
 }
@@ -203,6 +302,7 @@ static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t length, const unsigned ch
 {
     ssize_t r;
     uint16_t size;
+    unsigned char message[sizeof size + VPCD_SEND_BUFFER];
 
     if (!ctx || length > 0xFFFF) {
         errno = EINVAL;
@@ -211,10 +311,19 @@ static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t length, const unsigned ch
 
     /* send size of message on 2 bytes */
     size = htons((uint16_t) length);
-    r = sendall(ctx->client_sock, (void *) &size, sizeof size);
-    if (r == sizeof size)
-        /* send message */
-        r = sendall(ctx->client_sock, buffer, length);
+    if (length <= VPCD_SEND_BUFFER) {
+        /* a single segment avoids waiting for the delayed ACK of vicc */
+        memcpy(message, &size, sizeof size);
+        memcpy(message + sizeof size, buffer, length);
+        r = sendall(ctx->client_sock, message, sizeof size + length);
+        if (r > 0)
+            r -= sizeof size;
+    } else {
+        r = sendall(ctx->client_sock, (void *) &size, sizeof size);
+        if (r == sizeof size)
+            /* send message */
+            r = sendall(ctx->client_sock, buffer, length);
+    }
 
     if (r < 0)
         vicc_eject(ctx);
@@ -235,7 +344,7 @@ static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer)
 
     /* receive size of message on 2 bytes */
     r = recvall(ctx->client_sock, &size, sizeof size);
-    if (r < sizeof size)
+    if (r < 0 || (size_t) r < sizeof size)
         return r;
 
     size = ntohs(size);
@@ -253,15 +362,58 @@ static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer)
     return recvall(ctx->client_sock, *buffer, size);
 }
 
+static ssize_t recvFromVICCInto(struct vicc_ctx *ctx, size_t length, unsigned char *buffer)
+{
+    ssize_t r;
+    uint16_t size;
+    size_t left;
+    unsigned char discard[256];
+
+    if (!ctx || (length && !buffer)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* receive size of message on 2 bytes */
+    r = recvall(ctx->client_sock, &size, sizeof size);
+    if (r < 0 || (size_t) r < sizeof size)
+        return r;
+
+    size = ntohs(size);
+
+    if (size <= length)
+        /* receive message */
+        return recvall(ctx->client_sock, buffer, size);
+
+    /* drop the message to stay in sync with vicc */
+    for (left = size; left; left -= r) {
+        r = recvall(ctx->client_sock, discard,
+                left < sizeof discard ? left : sizeof discard);
+        if (r <= 0)
+            return -1;
+    }
+
+    return size;
+}
+
 int vicc_eject(struct vicc_ctx *ctx)
 {
     int r = 0;
     if (ctx && ctx->client_sock > 0) {
+        /* shut down the connection explicitly so that anybody watching a
+         * duplicate of the socket gets notified as well */
+#ifdef _WIN32
+        shutdown(ctx->client_sock, SD_BOTH);
+#else
+        shutdown(ctx->client_sock, SHUT_RDWR);
+#endif
         if (close(ctx->client_sock) < 0) {
             r -= 1;
         }
         ctx->client_sock = INVALID_SOCKET;
     }
+    if (ctx)
+        ctx->rx_len = 0;
     return r;
 }
 
@@ -279,6 +431,8 @@ struct vicc_ctx * vicc_init(const char *hostname, unsigned short port)
     ctx->server_sock = INVALID_SOCKET;
     ctx->client_sock = INVALID_SOCKET;
     ctx->port = port;
+    ctx->rx_len = 0;
+    ctx->connection = 0;
 
 #ifdef _WIN32
     WSADATA wsaData;
@@ -296,6 +450,8 @@ struct vicc_ctx * vicc_init(const char *hostname, unsigned short port)
             goto err;
         }
         ctx->client_sock = connectsock(hostname, port);
+        if (ctx->client_sock != INVALID_SOCKET)
+            ctx->connection++;
     } else {
         ctx->server_sock = opensock(port);
         if (ctx->server_sock == INVALID_SOCKET) {
@@ -348,11 +504,32 @@ ssize_t vicc_transmit(struct vicc_ctx *ctx,
         if (r > 0 && rapdu)
             r = recvFromVICC(ctx, rapdu);
 
+        if (r <= 0)
+            vicc_eject(ctx);
+
         unlock(ctx->io_lock);
     }
 
-    if (r <= 0)
-        vicc_eject(ctx);
+    return r;
+}
+
+ssize_t vicc_transmit_into(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        size_t rapdu_len, unsigned char *rapdu)
+{
+    ssize_t r = -1;
+
+    if (ctx && lock(ctx->io_lock)) {
+        r = sendToVICC(ctx, apdu_len, apdu);
+
+        if (r > 0)
+            r = recvFromVICCInto(ctx, rapdu_len, rapdu);
+
+        if (r <= 0)
+            vicc_eject(ctx);
+
+        unlock(ctx->io_lock);
+    }
 
     return r;
 }
@@ -360,11 +537,12 @@ ssize_t vicc_transmit(struct vicc_ctx *ctx,
 
 int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs)
 {
+
     if (!ctx)
         return 0;
 
     if (ctx->client_sock == INVALID_SOCKET) {
-        if (ctx->server_sock) {
+        if (ctx->server_sock != INVALID_SOCKET) {
             /* server mode, try to accept a client */
             ctx->client_sock = waitforclient(ctx->server_sock, secs, usecs);
             if (!ctx->client_sock) {
@@ -374,6 +552,8 @@ int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs)
             /* client mode, try to connect (again) */
             ctx->client_sock = connectsock(ctx->hostname, ctx->port);
         }
+        if (ctx->client_sock != INVALID_SOCKET)
+            ctx->connection++;
     }
 
     if (ctx->client_sock == INVALID_SOCKET)
@@ -435,3 +615,77 @@ int vicc_reset(struct vicc_ctx *ctx) {
 
     return r;
 }
+
+int vicc_getfd(struct vicc_ctx *ctx)
+{
+    if (!ctx || ctx->client_sock == INVALID_SOCKET)
+        return -1;
+
+    return (int) ctx->client_sock;
+}
+
+ssize_t vicc_receive_nb(struct vicc_ctx *ctx, unsigned char **buffer)
+{
+    ssize_t r;
+    size_t size;
+    unsigned char *p;
+
+    if (!ctx || !buffer) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!lock(ctx->io_lock))
+        return -1;
+
+    if (ctx->rx_len < sizeof ctx->rx_size) {
+        /* receive size of message on 2 bytes */
+        r = recvavail(ctx->client_sock, ctx->rx_size + ctx->rx_len,
+                sizeof ctx->rx_size - ctx->rx_len);
+        if (r <= 0)
+            goto err;
+        ctx->rx_len += r;
+        if (ctx->rx_len < sizeof ctx->rx_size) {
+            r = 0;
+            goto err;
+        }
+
+        size = (ctx->rx_size[0] << 8) | ctx->rx_size[1];
+        if (!size) {
+            ctx->rx_len = 0;
+            r = 0;
+            goto err;
+        }
+        p = realloc(*buffer, size);
+        if (!p) {
+            errno = ENOMEM;
+            r = -1;
+            goto err;
+        }
+        *buffer = p;
+    }
+    size = (ctx->rx_size[0] << 8) | ctx->rx_size[1];
+
+    /* receive message */
+    r = recvavail(ctx->client_sock,
+            *buffer + (ctx->rx_len - sizeof ctx->rx_size),
+            size - (ctx->rx_len - sizeof ctx->rx_size));
+    if (r <= 0)
+        goto err;
+    ctx->rx_len += r;
+
+    if (ctx->rx_len - sizeof ctx->rx_size == size) {
+        ctx->rx_len = 0;
+        r = size;
+    } else {
+        r = 0;
+    }
+
+err:
+    if (r < 0)
+        vicc_eject(ctx);
+
+    unlock(ctx->io_lock);
+
+    return r;
+}
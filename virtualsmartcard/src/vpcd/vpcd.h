@@ -48,6 +48,13 @@ struct vicc_ctx {
         char *hostname;
         unsigned short port;
         void *io_lock;
+        /* state of vicc_receive_nb: length prefix and number of bytes
+         * received so far including the prefix */
+        unsigned char rx_size[2];
+        size_t rx_len;
+        /* counts the established connections, which tells apart a new
+         * connection that reuses the file descriptor of an old one */
+        unsigned long connection;
 };
 
 #ifdef __cplusplus
@@ -58,6 +65,9 @@ extern "C" {
 /** Standard port of the virtual smart card reader */
 #define VPCDPORT 35963
 
+/** Prefix of a hostname that denotes the path of a Unix domain socket */
+#define VPCD_UNIX_PREFIX "unix:"
+
 /**
  * @brief Initialize the module
  *
@@ -108,6 +118,49 @@ ssize_t vicc_transmit(struct vicc_ctx *ctx,
         size_t apdu_len, const unsigned char *apdu,
         unsigned char **rapdu);
 
+/**
+ * @brief Send an APDU to the virtual smart card and receive the response
+ * directly into the caller's buffer.
+ *
+ * @param[in]  apdu_len  Number of bytes to send
+ * @param[in]  apdu      Data to be sent
+ * @param[in]  rapdu_len Size of \a rapdu
+ * @param[out] rapdu     Data received
+ *
+ * @return On success, the call returns the number of bytes of the response.
+ *         If this is greater than \a rapdu_len, the response has been
+ *         discarded.
+ *         On error, -1 is returned, and errno is set appropriately.
+ */
+ssize_t vicc_transmit_into(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        size_t rapdu_len, unsigned char *rapdu);
+
+/**
+ * @brief Get the socket of the current connection for polling.
+ *
+ * @return The socket or -1 if not connected.
+ */
+int vicc_getfd(struct vicc_ctx *ctx);
+
+/**
+ * @brief Receive a message without blocking.
+ *
+ * Only the data which is already available is read. A partially received
+ * message is kept until the rest of it is received with the next call. Empty
+ * messages are skipped.
+ *
+ * @param[in,out] buffer Data received. Memory will be reused (via \a
+ *                       realloc) and should be freed by the caller if no
+ *                       longer needed. The same buffer needs to be passed
+ *                       until the message is complete.
+ *
+ * @return The number of bytes of the complete message, 0 if the message is
+ *         not yet complete or -1 if the connection has been closed or an
+ *         error occurred.
+ */
+ssize_t vicc_receive_nb(struct vicc_ctx *ctx, unsigned char **buffer);
+
 #ifdef  __cplusplus
 }
 #endif